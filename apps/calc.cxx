@@ -47,8 +47,7 @@ int UDOS_32Main(char32_t[])
     minusBtn.width = 12;
     minusBtn.height = 12;
     minusBtn.SetText("-");
-    while (!calcWindow.isClosed)
-        Task::Switch();
+    calcWindow.closeEvent.Wait();
     calcWindow.Kill();
     return 0;
 }
@@ -48,8 +48,7 @@ int UDOS_32Main(char32_t[])
     });
     consoleWin->AddChildDirect(attachToKernelBtn.value());
 
-    while (!consoleWin->isClosed)
-        Task::Switch();
+    consoleWin->closeEvent.Wait();
     consoleWin->Kill();
     return 0;
 }
@@ -158,8 +158,7 @@ int UDOS_32Main(char32_t[])
     PCI::Driver::AddSystem(driver);
 
     TTY::Print("iHDA driver online! :3\n");
-    while(1)
-        Task::Switch();
+    Task::Suspend();
     TTY::Print("iHDA driver says goodbye! :3\n");
     return 0;
 }
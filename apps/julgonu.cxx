@@ -1543,8 +1543,7 @@ int UDOS_32Main(char32_t[])
 
     gameWindow.width = gameViewport.width + 12;
     gameWindow.height = gameViewport.height + 32;
-    while (!gameWindow.isClosed)
-        Task::Switch();
+    gameWindow.closeEvent.Wait();
     return 0;
 }
 
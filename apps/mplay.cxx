@@ -41,8 +41,7 @@ int UDOS_32Main(char32_t[])
     sb16->sampleRate = 8000;//22050;
     sb16->Start();
 
-    while (!appWin.isClosed)
-        Task::Switch();
+    appWin.closeEvent.Wait();
     appWin.Kill();
 #endif
     return 0;
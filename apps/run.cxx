@@ -48,14 +48,12 @@ int UDOS_32Main(char32_t[])
             errorWin->height = 48;
             errorWin->Decorate();
             g_Desktop->AddChildDirect(errorWin.value());
-            while (!errorWin->isClosed)
-                Task::Switch();
+            errorWin->closeEvent.Wait();
             errorWin.reset();
         }, nullptr, false);
     });
     runWin->AddChildDirect(runBtn.value());
-    while (!runWin->isClosed)
-        Task::Switch();
+    runWin->closeEvent.Wait();
     return 0;
 }
 
@@ -11,6 +11,7 @@
 #include <kernel/assert.hxx>
 #include <kernel/task.hxx>
 #include <kernel/gdt.hxx>
+#include <kernel/defer.hxx>
 
 // Soundblaster IRQ table
 static const unsigned char irqToNumber[4][2] =
@@ -87,8 +88,7 @@ public:
         // Send first DSP reset
         IO_Out8(0x206 + this->base, 1);
         // Wait 3ms
-        for (size_t i = 0; i < 30000; i++)
-            ;
+        Task::Sleep(3000);
 
         // Do last DSP reset
         IO_Out8(0x206 + this->base, 0);
@@ -175,30 +175,34 @@ public:
 };
 SoundBlaster16* SoundBlaster16::singleton = nullptr;
 
+/// @brief Refill the buffer the soundcard played
+static void sb16_refill(void *)
+{
+#ifdef DEBUG
+    TTY::Print("sb16: Refilling the buffer\n");
+#endif
+    if (SoundBlaster16::singleton)
+        SoundBlaster16::singleton->FlushBuffer();
+}
+static Defer::Work refillWork(&sb16_refill, nullptr);
+
 /// @brief SoundBlaster IRQ handler
 extern "C" void IntEDh_Handler()
 {
-    Task::DisableSwitch();
-
-    TTY::Print("sb16: Handling IRQ ED for soundcard\n");
     if (SoundBlaster16::singleton)
     {
-        auto* sb16 = SoundBlaster16::singleton;
-        sb16->FlushBuffer();
-        IO_In8(0x20E + sb16->base); // Acknowledge to the DSP
+        IO_In8(0x20E + SoundBlaster16::singleton->base); // Acknowledge to the DSP
+        Defer::Queue(refillWork);
     }
 
-    Task::Schedule();
     PIC::Get().EOI(5);
-    Task::EnableSwitch();
 }
 
 int UDOS_32Main(char32_t[])
 {
     IDT::AddHandler(0xED, &IntEDh_Handler);
     TTY::Print("SB16 setup, drive running as TSR!\n");
-    while(1)
-        Task::Switch();
+    Task::Suspend();
     TTY::Print("SB16 driver going offline! ~~ Ciao!\n");
     IDT::RemoveHandler(0xED, &IntEDh_Handler);
     return 0;
@@ -0,0 +1,19 @@
+/// swbench.cxx
+/// Task switch latency, software switch against hardware TSS switch
+
+#include <kernel/task.hxx>
+#include <kernel/tty.hxx>
+#include <kernel/smp.hxx>
+
+#define SWBENCH_ROUNDS 10000
+
+__attribute__((section(".data.startup"))) int UDOS_32Main(char32_t[])
+{
+    // The first run warms up the caches and the TLB
+    Task::MeasureSwitch(SWBENCH_ROUNDS / 10);
+    auto times = Task::MeasureSwitch(SWBENCH_ROUNDS);
+    TTY::Print("swbench: %u rounds on %u processors, cycles per round trip (two switches)\n",
+               SWBENCH_ROUNDS, SMP::GetCount());
+    TTY::Print("swbench: software %u, hardware TSS %u\n", times.soft, times.hard);
+    return 0;
+}
@@ -17,6 +17,12 @@
 #include <kernel/iso9660.hxx>
 #include <kernel/atapi.hxx>
 #include <kernel/ps2.hxx>
+#include <kernel/pit.hxx>
+#include <kernel/defer.hxx>
+#include <kernel/clock.hxx>
+
+#define SYSEX_FRAME_MS 20 // Longest the desktop goes without being redrawn
+#define SYSEX_MAX_TASKS 24 // Rows of the task list
 
 extern std::optional<UI::Desktop> g_Desktop;
 
@@ -44,9 +50,7 @@ extern std::optional<ISO9660::Device> isoCdrom;
 int UDOS_32Main(char32_t[])
 {
     // Sometimes kernel_main gets executed twice
-    Task::DisableSwitch();
     PIC::Get().Remap(0xE8, 0xF0);
-    Task::EnableSwitch();
     asm("sti"); // Always enable interrupts on the dummy task
 #if 0
     static std::string menuConfig;
@@ -193,7 +197,7 @@ int UDOS_32Main(char32_t[])
             runWin.AddChildDirect(filepathTextbox.value());
 
             static Task::TSS* runTask = nullptr;
-            static bool performRunTask = false;
+            static Task::Event performRunTask(true);
             auto& runBtn = runWin.AddChild<UI::Button>();
             runBtn.x = 0;
             runBtn.y = 16;
@@ -202,20 +206,21 @@ int UDOS_32Main(char32_t[])
             runBtn.SetText("Run");
             runBtn.OnClick = ([](UI::Widget &, unsigned, unsigned, bool, bool) -> void {
                 if(runTask != nullptr)
-                    performRunTask = true;
+                    performRunTask.Set();
                 
                 runTask = &Task::Add([]() -> void  {
                 doRunTask:
                     static char tmpbuf[100];
                     for(size_t i = 0; i < 100; i++)
                         tmpbuf[i] = filepathTextbox->textBuffer[i];
+                    Task::GetCurrent().name = tmpbuf;
 
                     static auto* imageBase = (void *)0x1000000;
                     static size_t offset = 0;
                     auto r = isoCdrom->ReadFile(tmpbuf, [](void *data, size_t len) -> bool {
                         TTY::Print("Reading 0x%x bytes at %p\n", len, (uint8_t *)imageBase + offset);
                         //std::memcpy((uint8_t *)imageBase + offset, data, len);
-                        DRM::Blowfish::Decrypt((uint8_t *)imageBase + offset, serialKeyParray, serialKeySbox, data, len);
+                        DRM::Blowfish::DecryptParallel((uint8_t *)imageBase + offset, serialKeyParray, serialKeySbox, data, len);
                         offset += len;
                         return true;
                     });
@@ -228,19 +233,25 @@ int UDOS_32Main(char32_t[])
                         errorWin.width = 150;
                         errorWin.height = 48;
                         errorWin.Decorate();
-                        while (!errorWin.isClosed)
-                            Task::Switch();
+                        errorWin.closeEvent.Wait();
                     }
                     else
                     {
                         TTY::Print("Executing at %p!\n", imageBase);
                         const auto* info = reinterpret_cast<AppKit::ProgramInfo*>(imageBase);
+                        // Each Run task has its own, another one may be
+                        // running a program at the same time
+                        HimemAlloc::Arena appArena;
+                        HimemAlloc::InitArena(appArena, HimemAlloc::Manager::GetDefault());
+                        Task::GetCurrent().arena = &appArena;
                         int r = info->entryPoint(nullptr);
+                        Task::GetCurrent().arena = nullptr;
+                        UI::Manager::Get().Detach(g_Desktop.value(), appArena);
+                        HimemAlloc::ReleaseArena(appArena);
                         //Task::Add(, nullptr, false);
                     }
 
-                    while(!performRunTask)
-                        ;
+                    performRunTask.Wait();
                     goto doRunTask;
                 }, nullptr, false);
             });
@@ -255,18 +266,19 @@ int UDOS_32Main(char32_t[])
         systemBtn.OnClick = ([](UI::Widget &, unsigned, unsigned, bool, bool) -> void {
             Task::Add([]()
             {
+                Task::GetCurrent().name = "system";
                 auto& systemWin = g_Desktop->AddChild<UI::Window>();
                 systemWin.SetText("System information");
                 systemWin.x = 0;
                 systemWin.y = 0;
-                systemWin.width = 200;
-                systemWin.height = 150;
+                systemWin.width = 440;
+                systemWin.height = 240;
                 systemWin.Decorate();
 
                 auto& infoTextbox = systemWin.AddChild<UI::Textbox>();
                 infoTextbox.SetText("...");
                 infoTextbox.y = infoTextbox.x = 0;
-                infoTextbox.width = systemWin.width - 24;
+                infoTextbox.width = 176;
                 infoTextbox.height = systemWin.height - 32;
                 infoTextbox.OnUpdate = [](UI::Widget& w)
                 {
@@ -281,14 +293,88 @@ int UDOS_32Main(char32_t[])
                         return tmpbuf;
                     };
                     auto ts = Task::GetSummary();
-                    auto& mm = HimemAlloc::Manager::GetDefault();
-                    auto ms = HimemAlloc::GetInfo(mm);
-                    o.SetText(fmtPrint("ATasks: %u\nTTasks: %u\nMRegions: %u\nMTotal: %uB\nMFree: %uB\nMUsed: %uB", ts.nActive, ts.nTotal, mm.max_regions, ms.total, ms.free, ms.total - ms.free));
+                    auto ms = HimemAlloc::GetStats(HimemAlloc::Manager::GetDefault());
+                    unsigned idle = ts.uptimeMs >= 100 ? ts.idleMs / (ts.uptimeMs / 100) : 0;
+                    uint32_t irqMaxNs = 0;
+                    for (unsigned v = DEFER_IRQ_BASE; v < DEFER_IRQ_BASE + DEFER_IRQ_COUNT; v++)
+                        if (Defer::GetIRQStats(v).max_ns > irqMaxNs)
+                            irqMaxNs = Defer::GetIRQStats(v).max_ns;
+                    o.SetText(fmtPrint("ATasks: %u\nTTasks: %u\nIdle: %u%%\nIRQ off: %uus max\nMTotal: %uB\nMFree: %uB\nMUsed: %uB\nMPeak: %uB\nAllocs: %u\nFrees: %u\nFailed: %u\nObjects: %u small, %u large",
+                        ts.nActive, ts.nTotal, idle, irqMaxNs / 1000, ms.total, ms.free, ms.in_use, ms.peak, ms.n_allocs, ms.n_frees, ms.n_failed,
+                        ms.n_allocs - ms.n_frees - ms.live[SLAB_NUM_CLASSES], ms.live[SLAB_NUM_CLASSES]));
                 };
                 infoTextbox.OnUpdate(infoTextbox);
 
-                while (!systemWin.isClosed)
-                    Task::Switch();
+                // Task manager, the share of the processor each task took
+                // since it was added and how long it waits to run once woken
+                auto& tasksTextbox = systemWin.AddChild<UI::Textbox>();
+                tasksTextbox.SetText("...");
+                tasksTextbox.y = 0;
+                tasksTextbox.x = infoTextbox.width + 4;
+                tasksTextbox.width = systemWin.width - 24 - tasksTextbox.x;
+                tasksTextbox.height = systemWin.height - 32;
+                tasksTextbox.OnUpdate = [](UI::Widget& w)
+                {
+                    auto& o = static_cast<UI::Textbox&>(w);
+                    static Task::TaskInfo infos[SYSEX_MAX_TASKS];
+                    static char tmpbuf[1024] = {};
+                    static uint32_t latency[TASK_LATENCY_BUCKETS];
+                    size_t len = 0;
+                    auto fmtAppend = [&len](const char *fmt, ...)
+                    {
+                        va_list args;
+                        va_start(args, fmt);
+                        TTY::Print_1(tmpbuf + len, sizeof(tmpbuf) - len, fmt, args);
+                        va_end(args);
+                        len += std::strlen(tmpbuf + len);
+                    };
+
+                    unsigned n = Task::GetTasks(infos, SYSEX_MAX_TASKS);
+                    for (unsigned b = 0; b < TASK_LATENCY_BUCKETS; b++)
+                        latency[b] = 0;
+                    fmtAppend("Task CPU Run Vol/Invol Wait p50/max\n");
+                    for (unsigned i = 0; i < n && len < sizeof(tmpbuf) - 64; i++)
+                    {
+                        const auto& info = infos[i];
+                        uint32_t runMs = Clock::ToMs(info.run_ns);
+                        uint32_t lifeMs = Clock::ToMs(info.life_ns);
+                        unsigned cpu = lifeMs >= 100 ? runMs / (lifeMs / 100) : 0;
+
+                        // Buckets the median and the longest wait fall in
+                        uint32_t waits = 0, seen = 0;
+                        unsigned p50 = 0, max = 0;
+                        for (unsigned b = 0; b < TASK_LATENCY_BUCKETS; b++)
+                        {
+                            waits += info.latency[b];
+                            latency[b] += info.latency[b];
+                        }
+                        for (unsigned b = 0; b < TASK_LATENCY_BUCKETS; b++)
+                        {
+                            if (info.latency[b] == 0)
+                                continue;
+                            if (seen < (waits + 1) / 2 && seen + info.latency[b] >= (waits + 1) / 2)
+                                p50 = b;
+                            seen += info.latency[b];
+                            max = b;
+                        }
+
+                        if (info.name != nullptr)
+                            fmtAppend("%s", info.name);
+                        else
+                            fmtAppend("#%u", info.id);
+                        fmtAppend("%c %u%% %ums %u/%u <%u/<%uus\n", info.is_running ? '*' : ' ', cpu, runMs,
+                            info.n_voluntary, info.n_involuntary, 1u << p50, 1u << max);
+                    }
+
+                    fmtAppend("Wait (us):");
+                    for (unsigned b = 0; b < TASK_LATENCY_BUCKETS; b++)
+                        if (latency[b] != 0 && len < sizeof(tmpbuf) - 32)
+                            fmtAppend(" <%u:%u", 1u << b, latency[b]);
+                    o.SetText(tmpbuf);
+                };
+                tasksTextbox.OnUpdate(tasksTextbox);
+
+                systemWin.closeEvent.Wait();
             }, nullptr, false);
         });
     });
@@ -297,6 +383,8 @@ int UDOS_32Main(char32_t[])
     HimemAlloc::Print(HimemAlloc::Manager::GetDefault());
     // Filesys::Init();
 
+    // The desktop is drawn by this loop, keep it ahead of the windows
+    Task::SetPriority(Task::GetCurrent(), PRIORITY_HIGH);
     auto &uiMan = UI::Manager::Get();
     while (1)
     {
@@ -307,7 +395,9 @@ int UDOS_32Main(char32_t[])
                           ps2Mouse->buttons[0], ps2Mouse->buttons[1], ch);
         uiMan.Update();
         g_KFrameBuffer.MoveMouse(ps2Mouse->GetX(), ps2Mouse->GetY());
-        Task::Switch();
+        // Sleep until a key comes or it's time for the next frame, so an
+        // idle desktop lets the processor halt
+        ps2Keyboard->keyEvent.Wait(PIT::MsToTicks(SYSEX_FRAME_MS));
     }
     return 0;
 }
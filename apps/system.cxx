@@ -33,12 +33,12 @@ __attribute__((section(".data.startup"))) int UDOS_32Main(char32_t[])
             return tmpbuf;
         };
         auto ts = Task::GetSummary();
-        o.SetText(fmtPrint("A-Tasks: %u\nT-Tasks: %u", ts.nActive, ts.nTotal));
+        unsigned idle = ts.uptimeMs >= 100 ? ts.idleMs / (ts.uptimeMs / 100) : 0;
+        o.SetText(fmtPrint("A-Tasks: %u\nT-Tasks: %u\nIdle: %u%%", ts.nActive, ts.nTotal, idle));
     };
     infoTextbox.OnUpdate(infoTextbox);
 
-    while (!systemWin.isClosed)
-        Task::Switch();
+    systemWin.closeEvent.Wait();
     systemWin.Kill();
     return 0;
 }
@@ -90,8 +90,7 @@ __attribute__((section(".data.startup"))) int UDOS_32Main(char32_t[])
     });
     tourWin->AddChildDirect(mysteryBtn[3].value());
 
-    while (!tourWin->isClosed)
-        Task::Switch();
+    tourWin->closeEvent.Wait();
     tourWin->Kill();
     return 0;
 }
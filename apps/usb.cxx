@@ -147,8 +147,7 @@ struct Device : public PCI::Device
 int UDOS_32Main(char32_t[])
 {
     TTY::Print("USB driver online! ^-^\n");
-    while(1)
-        Task::Switch();
+    Task::Suspend();
     TTY::Print("USB driver says goodbye! ^-^ :3\n");
     return 0;
 }
@@ -0,0 +1,90 @@
+#include <cstddef>
+#include <cstring>
+#include "acpi.hxx"
+#include "tty.hxx"
+
+#define ACPI_BDA_EBDA (0x40E) // Segment of the EBDA, kept on the BDA
+
+struct RSDP
+{
+    char signature[8]; // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} PACKED;
+
+static const ACPI::Header *rsdt = nullptr;
+static bool isProbed = false;
+
+static bool acpi_checksum(const void *data, size_t size)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < size; i++)
+        sum += static_cast<const uint8_t *>(data)[i];
+    return sum == 0;
+}
+
+/* The RSDP lies on a 16 byte boundary of the memory given */
+static const RSDP *acpi_scan(uintptr_t start, uintptr_t end)
+{
+    for (uintptr_t addr = start; addr + sizeof(RSDP) <= end; addr += 16)
+    {
+        auto *rsdp = reinterpret_cast<const RSDP *>(addr);
+        if (!std::memcmp(rsdp->signature, "RSD PTR ", 8) && acpi_checksum(rsdp, sizeof(RSDP)))
+            return rsdp;
+    }
+    return nullptr;
+}
+
+/* Look on the first KiB of the EBDA, then on the BIOS ROM */
+static void acpi_probe()
+{
+    isProbed = true;
+    // Read in assembly, gcc takes pointers below 4 KiB for null plus an offset
+    uint32_t ebdaSeg;
+    asm volatile("\tmovzwl (%1),%0\r\n"
+                 : "=r"(ebdaSeg)
+                 : "r"(ACPI_BDA_EBDA)
+                 : "memory");
+    uintptr_t ebda = ComputeLinearAddr(ebdaSeg, 0);
+    const RSDP *rsdp = nullptr;
+    if (ebda != 0)
+        rsdp = acpi_scan(ebda, ebda + 1024);
+    if (rsdp == nullptr)
+        rsdp = acpi_scan(0xE0000, 0x100000);
+    if (rsdp == nullptr)
+    {
+        TTY::Print("acpi: No RSDP found\n");
+        return;
+    }
+
+    auto *table = reinterpret_cast<const ACPI::Header *>(rsdp->rsdt);
+    if (std::memcmp(table->signature, "RSDT", 4) || !acpi_checksum(table, table->length))
+    {
+        TTY::Print("acpi: Invalid RSDT at %p\n", table);
+        return;
+    }
+    rsdt = table;
+    TTY::Print("acpi: RSDT at %p, revision %u\n", rsdt, rsdp->revision);
+}
+
+/// @brief Find a table by its signature
+/// @return The table, nullptr if there's none or it's corrupt
+const ACPI::Header *ACPI::FindTable(const char *signature)
+{
+    if (!isProbed)
+        acpi_probe();
+    if (rsdt == nullptr)
+        return nullptr;
+
+    size_t count = (rsdt->length - sizeof(ACPI::Header)) / sizeof(uint32_t);
+    auto *entries = reinterpret_cast<const uint32_t *>(rsdt + 1);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto *table = reinterpret_cast<const ACPI::Header *>(entries[i]);
+        if (!std::memcmp(table->signature, signature, 4) && acpi_checksum(table, table->length))
+            return table;
+    }
+    return nullptr;
+}
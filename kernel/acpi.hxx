@@ -0,0 +1,27 @@
+#ifndef ACPI_HXX
+#define ACPI_HXX 1
+
+#include <cstdint>
+#include "vendor.hxx"
+
+/// @brief Tables the firmware describes the machine with, only read to find
+/// devices that can't be probed for
+namespace ACPI
+{
+struct Header
+{
+    char signature[4];
+    uint32_t length; // Of the whole table, this header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} PACKED;
+
+const ACPI::Header *FindTable(const char *signature);
+}
+
+#endif
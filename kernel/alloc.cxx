@@ -1,71 +1,161 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <bit>
 #include <new>
 #include "alloc.hxx"
+#ifndef HIMEM_HOSTED
+#include "task.hxx"
+#endif
 #include "tty.hxx"
 
 static HimemAlloc::Manager g_KMMaster;
 
+/* The managers chained to the first one go under its lock, the allocations
+ * are made by tasks so they can sleep on it */
+#ifndef HIMEM_HOSTED
+#define MEM_LOCK(master) Sync::LockGuard<Sync::RWLock> memGuard((master).lock)
+#define MEM_LOCK_SHARED(master) Sync::SharedGuard memGuard((master).lock)
+#else
+#define MEM_LOCK(master)
+#define MEM_LOCK_SHARED(master)
+#endif
+
 #define MAX_MEM_LOW 0x100000 // Max address range for low allocator
-#define LOW_ALLOC_SIZE 512   // Allocates in blocks of 512 bytes
-#define MAX_BLOCKS 512       // Max number of blocks
+#define LOW_NUM_UNITS (MAX_MEM_LOW / LOW_ALLOC_SIZE)
+#define LOW_NUM_WORDS (LOW_NUM_UNITS / 32)
 
 extern unsigned char lowMem[MAX_MEM_LOW];
 
-unsigned char lowBitmap[(MAX_MEM_LOW / LOW_ALLOC_SIZE) / 8] =
-{
-    0xF0, // 4, 512 byte paragraphs
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-};
+/* A bit per block of 512 bytes, set if it's in use. The first 8 blocks hold
+ * the IVT and the BDA so they're never given out */
+static uint32_t lowBitmap[LOW_NUM_WORDS] = { 0xFF };
+/* A bit set on the first block of every allocation, an allocation goes on
+ * until a free block or the start of the next one, so no list of the used
+ * blocks is needed */
+static uint32_t lowStarts[LOW_NUM_WORDS] = { 0x01 };
+/* Index of the bitmap, bit n set if word n has any free block */
+static uint32_t lowFreeWords[LOW_NUM_WORDS / 32] = { ~0u, ~0u };
+static_assert(LOW_NUM_WORDS == 64);
+
+static void low_set_range(size_t start, size_t n, bool used)
+{
+    while (n != 0)
+    {
+        size_t word = start / 32, bit = start % 32;
+        size_t count = n < 32 - bit ? n : 32 - bit;
+        uint32_t mask = (count == 32 ? ~0u : (1u << count) - 1) << bit;
+        if (used)
+            lowBitmap[word] |= mask;
+        else
+            lowBitmap[word] &= ~mask;
+
+        if (lowBitmap[word] == ~0u)
+            lowFreeWords[word / 32] &= ~(1u << (word % 32));
+        else
+            lowFreeWords[word / 32] |= 1u << (word % 32);
+        start += count;
+        n -= count;
+    }
+}
 
-struct LowMemBlock
+/** Count the clear bits from start onwards, up to limit, word_at gives the
+ * words of the bitmap to look at */
+template<typename F>
+static size_t low_count_clear(F &&word_at, size_t start, size_t limit)
 {
-    uint32_t addr_lo : 16;
-    uint32_t addr_hi : 4;
-    uint32_t n_para : 12;
-};
-static LowMemBlock lowUsedBlocks[MAX_BLOCKS] = {};
+    size_t i = start;
+    while (i < limit)
+    {
+        uint32_t word = word_at(i / 32) >> (i % 32);
+        if (word != 0)
+        {
+            i += std::countr_zero(word);
+            break;
+        }
+        i += 32 - i % 32;
+    }
+    return (i < limit ? i : limit) - start;
+}
 
-/// @brief Adds a block of memory to the used block list
-/// @param addr Address of block
-/// @param n_para Number of paragraphs taken by the block
-void Alloc::AddUsedBlock(uintptr_t addr, size_t n_para)
+/** Count the free blocks right before unit, up to max */
+static size_t low_free_before(size_t unit, size_t max)
 {
-    for (size_t i = 0; i < MAX_BLOCKS; i++)
+    size_t i = unit;
+    while (i > 0 && unit - i < max)
     {
-        auto *block = &lowUsedBlocks[i];
-        if (block->n_para == 0)
+        /* Block i - 1 goes on the top bit, the ones after it are shifted out */
+        uint32_t word = lowBitmap[(i - 1) / 32] << (31 - (i - 1) % 32);
+        if (word != 0)
         {
-            block->addr_lo = addr;
-            block->addr_hi = addr >> 16;
-            block->n_para = n_para;
-            for (size_t j = addr / LOW_ALLOC_SIZE;
-                    j < (addr / LOW_ALLOC_SIZE) + n_para;
-                    j++)
-                Alloc::SetBitmap(lowBitmap, j, true);
-            return;
+            i -= std::countl_zero(word);
+            break;
         }
+        i -= (i - 1) % 32 + 1;
     }
+    return unit - i < max ? unit - i : max;
+}
+
+static inline size_t low_free_run(size_t start, size_t limit)
+{
+    return low_count_clear([](size_t w) { return lowBitmap[w]; }, start, limit < LOW_NUM_UNITS ? limit : LOW_NUM_UNITS);
+}
+
+/** Number of blocks of the allocation starting on unit */
+static inline size_t low_length(size_t unit)
+{
+    return 1 + low_count_clear([](size_t w) { return ~lowBitmap[w] | lowStarts[w]; }, unit + 1, LOW_NUM_UNITS);
+}
+
+static inline bool low_is_start(size_t unit)
+{
+    return unit < LOW_NUM_UNITS && (lowStarts[unit / 32] >> (unit % 32)) & 1;
+}
+
+/** First fit, words without free blocks are skipped through the index and
+ * the runs are measured a word at a time */
+static size_t low_find(size_t n)
+{
+    size_t i = 0;
+    while (i < LOW_NUM_UNITS)
+    {
+        size_t word = i / 32;
+        uint32_t words = lowFreeWords[word / 32] & (~0u << (word % 32));
+        if (words == 0)
+        {
+            i = (word / 32 + 1) * 32 * 32;
+            continue;
+        }
+        if ((size_t)std::countr_zero(words) != word % 32)
+            i = (word / 32 * 32 + std::countr_zero(words)) * 32;
+
+        /* Blocks before i count as used */
+        uint32_t used = lowBitmap[i / 32] | ((1u << (i % 32)) - 1);
+        if (used == ~0u)
+        {
+            i += 32 - i % 32;
+            continue;
+        }
+        i = i / 32 * 32 + std::countr_one(used);
+
+        size_t run = low_free_run(i, i + n);
+        if (run >= n)
+            return i;
+        i += run;
+    }
+    return LOW_NUM_UNITS;
+}
+
+/// @brief Adds a block of memory to the used block list
+/// @param addr Address of block
+/// @param n_para Number of paragraphs taken by the block
+void Alloc::AddUsedBlock(uintptr_t addr, size_t n_para)
+{
+    size_t unit = addr / LOW_ALLOC_SIZE;
+    if (n_para == 0 || unit + n_para > LOW_NUM_UNITS)
+        return;
+    low_set_range(unit, n_para, true);
+    lowStarts[unit / 32] |= 1u << (unit % 32);
 }
 
 void Alloc::SetBitmap(uint8_t bitmap[], size_t index, bool value)
@@ -86,52 +176,82 @@ bool Alloc::GetBitmap(uint8_t bitmap[], size_t index)
 /// @return Address allocated
 void *Alloc::GetLow(size_t n_para)
 {
-    uintptr_t address = 0;
-    size_t rem_para = n_para; // Remaining paragraphs
-    for (size_t i = 0; i < sizeof(lowBitmap) * 8 && rem_para; i++)
-    {
-        // Location is in use?
-        if (Alloc::GetBitmap(lowBitmap, i))
-        {
-            rem_para = n_para; // Stride broken, reset
-            continue;
-        }
-        if (rem_para == n_para) // Update address
-            address = i * LOW_ALLOC_SIZE;
-        rem_para--;
-    }
+    if (n_para == 0 || n_para > LOW_NUM_UNITS)
+        return nullptr;
 
-    if (rem_para)
+    size_t unit = low_find(n_para);
+    if (unit == LOW_NUM_UNITS)
         return nullptr;
 
-    Alloc::AddUsedBlock(address, n_para);
-    return (void *)address;
+    Alloc::AddUsedBlock(unit * LOW_ALLOC_SIZE, n_para);
+    return (void *)(unit * LOW_ALLOC_SIZE);
 }
 
+/// @brief Resize memory from GetLow, in place if the blocks around it are
+/// free (moving it down if only the ones before are)
 void *Alloc::ResizeLow(void *addr, size_t para)
 {
+    if (addr == nullptr)
+        return Alloc::GetLow(para);
+
+    size_t unit = (uintptr_t)addr / LOW_ALLOC_SIZE;
+    if ((uintptr_t)addr % LOW_ALLOC_SIZE || !low_is_start(unit))
+    {
+        TTY::Print("low: Bad resize of %p\n", addr);
+        return nullptr;
+    }
+
+    if (para == 0)
+    {
+        Alloc::FreeLow(addr);
+        return nullptr;
+    }
+
+    size_t n = low_length(unit);
+    if (para <= n)
+    {
+        low_set_range(unit + para, n - para, false);
+        return addr;
+    }
+
+    size_t after = low_free_run(unit + n, unit + para);
+    if (after == para - n)
+    {
+        low_set_range(unit + n, after, true);
+        return addr;
+    }
+
+    size_t before = low_free_before(unit, para - n - after);
+    if (before == para - n - after)
+    {
+        size_t new_unit = unit - before;
+        void *new_addr = (void *)(new_unit * LOW_ALLOC_SIZE);
+        memmove(new_addr, addr, n * LOW_ALLOC_SIZE);
+        lowStarts[unit / 32] &= ~(1u << (unit % 32));
+        Alloc::AddUsedBlock(new_unit * LOW_ALLOC_SIZE, para);
+        return new_addr;
+    }
+
     auto *p = Alloc::GetLow(para);
-    for (size_t i = 0; i < para * LOW_ALLOC_SIZE; i++)
-        ((uint8_t *)p)[i] = ((uint8_t *)addr)[i];
+    if (p == nullptr)
+        return nullptr;
+    memcpy(p, addr, n * LOW_ALLOC_SIZE);
     Alloc::FreeLow(addr);
     return p;
 }
 
 void Alloc::FreeLow(void *addr)
 {
-    for (size_t i = 0; i < MAX_BLOCKS; i++)
+    size_t unit = (uintptr_t)addr / LOW_ALLOC_SIZE;
+    if ((uintptr_t)addr % LOW_ALLOC_SIZE || !low_is_start(unit))
     {
-        auto *block = &lowUsedBlocks[i];
-        uintptr_t linear_addr = (block->addr_hi << 16) | block->addr_lo;
-        if (linear_addr == (uintptr_t)addr)
-        {
-            for (size_t j = linear_addr / LOW_ALLOC_SIZE;
-                    j < (linear_addr / LOW_ALLOC_SIZE) + block->n_para;
-                    j++)
-                Alloc::SetBitmap(lowBitmap, j, false);
-            return;
-        }
+        TTY::Print("low: Bad free of %p\n", addr);
+        return;
     }
+
+    size_t n = low_length(unit);
+    lowStarts[unit / 32] &= ~(1u << (unit % 32));
+    low_set_range(unit, n, false);
 }
 
 /* SOF allocator - this allocator, designed by me :D . Uses a slab for small
@@ -142,10 +262,14 @@ void Alloc::FreeLow(void *addr)
  *
  * The heap is "infinite" in the sense that we really never expand it. Since
  * the free block always is the fist block; the heap *will* take space
- * from the free block. This reduces complexity by a fuckton. */
+ * from the free block. This reduces complexity by a fuckton.
+ *
+ * Objects up to SLAB_MAX_SIZE never touch the block list, each size class
+ * keeps the pages that still have free objects and allocating/freeing is just
+ * a pop/push on the free list of the page. The pages themselves come from
+ * (and go back to) the block allocator. */
 
 // TODO: Add poison
-// TODO: We can run out of region space; We need a way to allocate extra master blocks.
 // TODO: We need to also consider that RAM hotswap is a thing; so we need to copy master blocks.
 // TODO: We need to make copies of the master RAM block; because RAM hotswap exists
 
@@ -157,6 +281,11 @@ HimemAlloc::Manager& HimemAlloc::Manager::GetDefault()
 int HimemAlloc::InitManager(HimemAlloc::Manager& master)
 {
     master.next = nullptr;
+    master.grow = nullptr;
+    master.release = nullptr;
+    master.failure = nullptr;
+    master.stats = HimemAlloc::Stats{};
+    master.low_water = DEFAULT_LOW_WATER;
     master.max_regions = DEFAULT_MAX_REGIONS;
     for (size_t i = 0; i < master.max_regions; i++)
     {
@@ -164,380 +293,1059 @@ int HimemAlloc::InitManager(HimemAlloc::Manager& master)
         region.addr = nullptr;
         region.free_size = 0;
         region.size = 0;
+        region.mem_base = nullptr;
+        region.mem_size = 0;
         region.head = nullptr;
+        region.n_used = 0;
         region.max_blocks = 0; /* Default for new blocks */
         region.blocks = nullptr;
+        region.spare_blocks = nullptr;
+        region.spare_tail = nullptr;
+        region.n_spare_blocks = 0;
+        region.growing_blocks = false;
+        region.empty_pages = nullptr;
+        region.page_base = nullptr;
+        region.n_pages = 0;
+        region.pages = nullptr;
+        for (auto &bin : region.bins)
+            bin = nullptr;
+        region.bin_map = 0;
+    }
+
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++)
+    {
+        auto &cache = master.slabs[i];
+        cache.obj_size = SLAB_MIN_SIZE << i;
+        cache.partial = nullptr;
+        cache.n_slabs = 0;
+        cache.n_free = 0;
+        cache.quick = nullptr;
+        cache.n_quick = 0;
     }
     return 0;
 }
 
+/** Obtain the bin of free blocks of the given size */
+static inline unsigned mem_bin(size_t size)
+{
+    return std::bit_width(size) - 1;
+}
+
+static void mem_bin_insert(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    unsigned bin = mem_bin(block.size);
+    block.free_prev = nullptr;
+    block.free_next = region.bins[bin];
+    if (block.free_next != nullptr)
+        block.free_next->free_prev = &block;
+    region.bins[bin] = &block;
+    region.bin_map |= static_cast<size_t>(1) << bin;
+}
+
+/** Take a block off its bin, must be done before its size changes */
+static void mem_bin_remove(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    unsigned bin = mem_bin(block.size);
+    if (block.free_prev != nullptr)
+        block.free_prev->free_next = block.free_next;
+    else
+        region.bins[bin] = block.free_next;
+    if (block.free_next != nullptr)
+        block.free_next->free_prev = block.free_prev;
+    if (region.bins[bin] == nullptr)
+        region.bin_map &= ~(static_cast<size_t>(1) << bin);
+}
+
 HimemAlloc::Region *HimemAlloc::AddRegion(HimemAlloc::Manager& master, void *addr, size_t size)
 {
+    MEM_LOCK(master);
     HimemAlloc::Region *region = nullptr;
     /* Record new region onto the master heap */
     for (size_t i = 0; i < master.max_regions; i++)
     {
-        region = &master.regions[i];
-        if (region->addr == nullptr)
+        if (master.regions[i].addr == nullptr)
+        {
+            region = &master.regions[i];
             break;
+        }
     }
 
     if (region == nullptr)
         return nullptr;
 
     /* Fill out info of region */
-    region->addr = (char *)addr;
-    region->free_size = size;
     region->size = size;
+    region->mem_base = nullptr;
+    region->mem_size = 0;
     region->blocks = (HimemAlloc::Block *)addr;
     region->head = (HimemAlloc::Block *)addr;
-    region->max_blocks = size / DEFAULT_DESCRIPTORS_PER_BYTES;
-    if (region->max_blocks < 8192)
-        region->max_blocks = 8192;
-
-    /* Fill heap correctly */
-    for (size_t i = 0; i < region->max_blocks; i++)
-    {
-        auto &tmp = region->blocks[i];
-        tmp.type = HimemAlloc::Block::Type::NOT_PRESENT;
-    }
+    region->n_used = 0;
+    region->max_blocks = DEFAULT_INITIAL_BLOCKS;
+    region->spare_blocks = nullptr;
+    region->spare_tail = nullptr;
+    region->n_spare_blocks = 0;
+    region->growing_blocks = false;
+    region->empty_pages = nullptr;
+
+    /* Stack up the descriptors, the first one ends up on top */
+    for (size_t i = region->max_blocks; i-- > 0; )
+        HimemAlloc::DeleteBlock(*region, region->blocks[i]);
+
+    /* Slab descriptors, one per page of the region, go after the blocks */
+    char *meta = (char *)&region->blocks[region->max_blocks];
+    region->page_base = (char *)((uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1));
+    region->n_pages = ((uintptr_t)addr + size - (uintptr_t)region->page_base + PAGE_SIZE - 1) / PAGE_SIZE;
+    region->pages = (HimemAlloc::Slab *)meta;
+    for (size_t i = 0; i < region->n_pages; i++)
+        region->pages[i].n_total = 0;
+    meta = (char *)&region->pages[region->n_pages];
+    meta = (char *)(((uintptr_t)meta + 15) & ~(uintptr_t)15);
+
+    /* The descriptors are not part of the heap */
+    size_t meta_size = meta - (char *)addr;
+    if (meta_size >= size)
+        return nullptr;
+    region->addr = meta;
+    region->free_size = size - meta_size;
 
     /* Create the genesis block - this block is used for ram */
-    auto &block = region->blocks[0];
+    for (auto &bin : region->bins)
+        bin = nullptr;
+    region->bin_map = 0;
+    auto &block = *HimemAlloc::AddBlock(*region);
     block.next = nullptr;
+    block.prev = nullptr;
+    block.addr = region->addr;
     block.type = HimemAlloc::Block::Type::FREE;
-
-    /* New genesis block = less free memory on region */
-    region->free_size -= sizeof(HimemAlloc::Block) * region->max_blocks;
-    region->blocks[0].size = region->free_size;
+    block.size = region->free_size;
+    mem_bin_insert(*region, block);
     return region;
 }
 
+static HimemAlloc::Block *mem_carve(HimemAlloc::Region &region, size_t size, size_t align, size_t skew, char *&addr);
+static void mem_release(HimemAlloc::Region &region, HimemAlloc::Block &block);
+
+/* Descriptors made on demand come in pages carved from the heap. The page
+ * describes itself so it doesn't hold up a descriptor on another page, and
+ * counts how many of its descriptors are spare so wholly spare pages can go
+ * back to the heap */
+struct BlockPage
+{
+    HimemAlloc::Block block; // Block of the page on the block allocator
+    size_t n_spare;
+    BlockPage *next; // List of wholly spare pages
+    BlockPage *prev;
+};
+#define MEM_RESERVE_BLOCKS 2 // Descriptors a carve may need to grow the table
+#define MEM_PAGE_HEADER ((sizeof(BlockPage) + sizeof(HimemAlloc::Block) - 1) / sizeof(HimemAlloc::Block))
+#define MEM_PAGE_BLOCKS (PAGE_SIZE / sizeof(HimemAlloc::Block) - MEM_PAGE_HEADER)
+
+/** Obtain the descriptor page of a descriptor, nullptr if it's part of the
+ * initial table of the region */
+static inline BlockPage *mem_block_page(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    if (&block >= region.blocks && &block < &region.blocks[DEFAULT_INITIAL_BLOCKS])
+        return nullptr;
+    return (BlockPage *)((uintptr_t)&block & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline void mem_spare_unlink(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    if (block.prev != nullptr)
+        block.prev->next = block.next;
+    else
+        region.spare_blocks = block.next;
+    if (block.next != nullptr)
+        block.next->prev = block.prev;
+    else
+        region.spare_tail = block.prev;
+    region.n_spare_blocks--;
+}
+
+/** Make another descriptor take the place of a USED block on the list */
+static void mem_move_block(HimemAlloc::Region &region, HimemAlloc::Block &from, HimemAlloc::Block &to)
+{
+    to.next = from.next;
+    to.prev = from.prev;
+    to.addr = from.addr;
+    to.size = from.size;
+    to.type = from.type;
+    if (to.prev != nullptr)
+        to.prev->next = &to;
+    else
+        region.head = &to;
+    if (to.next != nullptr)
+        to.next->prev = &to;
+}
+
+/** Carve a page of new descriptors out of the heap of the region */
+static void mem_grow_blocks(HimemAlloc::Region &region)
+{
+    char *addr;
+    region.growing_blocks = true;
+    auto *block = mem_carve(region, PAGE_SIZE, PAGE_SIZE, 0, addr);
+    region.growing_blocks = false;
+    if (block == nullptr)
+        return;
+
+    auto *page = (BlockPage *)addr;
+    mem_move_block(region, *block, page->block);
+    HimemAlloc::DeleteBlock(region, *block);
+    page->n_spare = 0;
+    page->next = page->prev = nullptr;
+    auto *blocks = (HimemAlloc::Block *)addr + MEM_PAGE_HEADER;
+    for (size_t i = MEM_PAGE_BLOCKS; i-- > 0; )
+        HimemAlloc::DeleteBlock(region, blocks[i]);
+    region.max_blocks += MEM_PAGE_BLOCKS;
+}
+
+static inline void mem_empty_unlink(HimemAlloc::Region &region, BlockPage &page)
+{
+    if (page.prev != nullptr)
+        page.prev->next = page.next;
+    else
+        region.empty_pages = page.next;
+    if (page.next != nullptr)
+        page.next->prev = page.prev;
+}
+
+/** Give wholly spare pages of descriptors back to the heap, but keep a page
+ * worth of spares around so a split/merge pattern doesn't make them go back
+ * and forth, unless the pages are all that's left on the region. This merges
+ * blocks so it can't be done while the block list is being worked on */
+static void mem_trim_blocks(HimemAlloc::Region &region)
+{
+    while (region.empty_pages != nullptr && (region.n_spare_blocks >= 2 * MEM_PAGE_BLOCKS
+            || region.n_used == (region.max_blocks - DEFAULT_INITIAL_BLOCKS) / MEM_PAGE_BLOCKS))
+    {
+        auto &page = *(BlockPage *)region.empty_pages;
+        mem_empty_unlink(region, page);
+        auto *blocks = (HimemAlloc::Block *)&page + MEM_PAGE_HEADER;
+        for (size_t i = 0; i < MEM_PAGE_BLOCKS; i++)
+            mem_spare_unlink(region, blocks[i]);
+        region.max_blocks -= MEM_PAGE_BLOCKS;
+
+        /* The page is going away with its own descriptor */
+        auto *block = HimemAlloc::AddBlock(region);
+        mem_move_block(region, page.block, *block);
+        mem_release(region, *block);
+    }
+}
+
+/** Obtain a NOT_PRESENT descriptor for a new block */
 HimemAlloc::Block *HimemAlloc::AddBlock(HimemAlloc::Region& region)
 {
-    /* Iterate through the blocks on heap, not all blocks are used
-     * and some are just there to be took over by newer blocks */
-    for (size_t i = 0; i < region.max_blocks; i++)
+    /* Grow while there's still enough descriptors for the carve itself */
+    if (region.n_spare_blocks <= MEM_RESERVE_BLOCKS && !region.growing_blocks)
+        mem_grow_blocks(region);
+
+    auto *block = region.spare_blocks;
+    if (block == nullptr)
     {
-        auto &block = region.blocks[i];
-        if (block.type == HimemAlloc::Block::Type::NOT_PRESENT)
-            return &block;
+        TTY::Print("No free blocks found\n");
+        return nullptr;
+    }
+    mem_spare_unlink(region, *block);
+    auto *page = mem_block_page(region, *block);
+    if (page != nullptr && page->n_spare-- == MEM_PAGE_BLOCKS)
+        mem_empty_unlink(region, *page);
+    return block;
+}
+
+/** Give a descriptor back to the region */
+void HimemAlloc::DeleteBlock(HimemAlloc::Region& region, HimemAlloc::Block &block)
+{
+    /* Descriptors of the initial table are handed out first, the ones on
+     * pages last, so the pages have a chance to become wholly spare */
+    auto *page = mem_block_page(region, block);
+    block.type = HimemAlloc::Block::Type::NOT_PRESENT;
+    if (page == nullptr || region.spare_tail == nullptr)
+    {
+        block.prev = nullptr;
+        block.next = region.spare_blocks;
+        if (block.next != nullptr)
+            block.next->prev = &block;
+        else
+            region.spare_tail = &block;
+        region.spare_blocks = &block;
+    }
+    else
+    {
+        block.next = nullptr;
+        block.prev = region.spare_tail;
+        region.spare_tail->next = &block;
+        region.spare_tail = &block;
     }
+    region.n_spare_blocks++;
 
-    // TODO: We could just expand the heap to avoid less errors.
-    TTY::Print("No free blocks found\n");
+    if (page != nullptr && ++page->n_spare == MEM_PAGE_BLOCKS)
+    {
+        page->prev = nullptr;
+        page->next = (BlockPage *)region.empty_pages;
+        if (page->next != nullptr)
+            page->next->prev = page;
+        region.empty_pages = page;
+    }
+}
+
+/* Header placed right before the payload of every block allocation, it points
+ * back to the descriptor so Free and Realloc don't need to look for it */
+struct BlockHeader
+{
+    HimemAlloc::Region *region;
+    HimemAlloc::Block *block;
+    uintptr_t magic;
+} __attribute__((aligned(16)));
+#define BLOCK_MAGIC 0x534F4621 // "SOF!"
+#define BLOCK_MIN_SIZE 32      // Leftovers smaller than this go with the block
+
+/** Size of a block holding a payload of the given size */
+static inline size_t mem_block_size(size_t size)
+{
+    return (size + sizeof(BlockHeader) + alignof(BlockHeader) - 1) & ~(alignof(BlockHeader) - 1);
+}
+
+static inline void mem_link_after(HimemAlloc::Block &block, HimemAlloc::Block &newblock)
+{
+    newblock.prev = &block;
+    newblock.next = block.next;
+    if (block.next != nullptr)
+        block.next->prev = &newblock;
+    block.next = &newblock;
+}
+
+/** Remove an empty block from the list */
+static inline void mem_drop_block(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    if (block.prev != nullptr)
+        block.prev->next = block.next;
+    else
+        region.head = block.next;
+    if (block.next != nullptr)
+        block.next->prev = block.prev;
+    HimemAlloc::DeleteBlock(region, block);
+}
+
+/** Obtain the first region in use, on the manager or the ones chained to
+ * it, for which fn returns true */
+template<typename M, typename F>
+static inline auto mem_find_if(M &master, F &&fn) -> decltype(&master.regions[0])
+{
+    for (auto *manager = &master; manager != nullptr; manager = manager->next)
+    {
+        for (size_t i = 0; i < manager->max_regions; i++)
+        {
+            auto &region = manager->regions[i];
+            if (region.addr != nullptr && fn(region))
+                return &region;
+        }
+    }
     return nullptr;
 }
 
-/** Fixes a block by merging next blocks into it (incase this block is a free block) */
-static inline void mem_fix_block(auto& block)
+/** Obtain the region that holds the given pointer */
+static HimemAlloc::Region *mem_find_region(HimemAlloc::Manager &master, const void *ptr)
+{
+    return mem_find_if(master, [ptr](auto &region) {
+        const char *end = (const char *)region.blocks + region.size;
+        return (const char *)ptr >= region.addr && (const char *)ptr < end;
+    });
+}
+
+/** Check if a free block can hold size bytes placed so that addr + skew is
+ * aligned to align, target is set to the highest such place */
+static inline bool mem_fits(const HimemAlloc::Block &block, size_t size, size_t align, size_t skew, uintptr_t &target)
+{
+    if (block.size < size)
+        return false;
+
+    uintptr_t start = (uintptr_t)block.addr;
+    uintptr_t aligned = (start + block.size - size + skew) & ~(uintptr_t)(align - 1);
+    if (aligned < start + skew)
+        return false;
+    target = aligned - skew;
+    return true;
+}
+
+#define MEM_BIN_SCAN 16 // Blocks looked at on the bin of the request itself
+
+/** Find a free block for the request. The bin of the size itself is only
+ * looked at briefly since its blocks may be too small, blocks on any bigger
+ * bin always fit (save for big alignments), so take from the smallest */
+static HimemAlloc::Block *mem_find_free(HimemAlloc::Region &region, size_t size, size_t align, size_t skew, uintptr_t &target)
 {
-    if (block.next != nullptr && block.type == HimemAlloc::Block::Type::FREE && block.next->type == HimemAlloc::Block::Type::FREE)
+    unsigned bin = mem_bin(size);
+    size_t n = 0;
+    for (auto *block = region.bins[bin]; block != nullptr && n < MEM_BIN_SCAN; block = block->free_next, n++)
+        if (mem_fits(*block, size, align, skew, target))
+            return block;
+
+    size_t map = region.bin_map & ~((static_cast<size_t>(2) << bin) - 1);
+    while (map != 0)
     {
-        block.size += block.next->size;
-        block.next->type = HimemAlloc::Block::Type::NOT_PRESENT;
-        block.next = block.next->next;
+        for (auto *block = region.bins[std::countr_zero(map)]; block != nullptr; block = block->free_next)
+            if (mem_fits(*block, size, align, skew, target))
+                return block;
+        map &= map - 1;
     }
+    return nullptr;
 }
 
-/** Allocate memory of specified size */
-void *HimemAlloc::Alloc(HimemAlloc::Manager &master, size_t size)
+/** Carve a USED block of size bytes from the end of a free block that fits,
+ * placed so that addr + skew is aligned to align. What's left on each side of
+ * it stays free */
+static HimemAlloc::Block *mem_carve(HimemAlloc::Region &region, size_t size, size_t align, size_t skew, char *&addr)
 {
-    for (size_t i = 0; i < master.max_regions; i++)
+    /* Grab the descriptors before looking for a block, growing the table
+     * carves from the heap too */
+    auto *afterblock = HimemAlloc::AddBlock(region);
+    if (afterblock == nullptr)
+        return nullptr;
+    auto *usedblock = HimemAlloc::AddBlock(region);
+    if (usedblock == nullptr)
     {
-        auto &region = master.regions[i];
-        if (region.addr == nullptr || region.free_size < size)
-            continue;
+        HimemAlloc::DeleteBlock(region, *afterblock);
+        return nullptr;
+    }
 
-        auto *block = region.head;
-        char *ptr = region.addr;
-        while (block != nullptr)
-        {
-            mem_fix_block(*block);
+    uintptr_t target;
+    auto *block = mem_find_free(region, size, align, skew, target);
+    if (block == nullptr)
+    {
+        HimemAlloc::DeleteBlock(region, *usedblock);
+        HimemAlloc::DeleteBlock(region, *afterblock);
+        return nullptr;
+    }
+
+    size_t before = target - (uintptr_t)block->addr;
+    size_t after = block->size - before - size;
+    if (after < BLOCK_MIN_SIZE)
+    {
+        HimemAlloc::DeleteBlock(region, *afterblock);
+        afterblock = nullptr;
+        size += after;
+    }
+    else
+    {
+        afterblock->type = HimemAlloc::Block::Type::FREE;
+    }
+
+    if (!before)
+    {
+        HimemAlloc::DeleteBlock(region, *usedblock);
+        usedblock = block;
+    }
+
+    mem_bin_remove(region, *block);
+    /* Free part AFTER the used block */
+    if (afterblock != nullptr)
+    {
+        afterblock->addr = (char *)target + size;
+        afterblock->size = after;
+        mem_link_after(*block, *afterblock);
+        mem_bin_insert(region, *afterblock);
+        block->size -= after;
+    }
+
+    /* Free part BEFORE the used block, which is this block itself */
+    if (before)
+    {
+        mem_link_after(*block, *usedblock);
+        block->size = before;
+        mem_bin_insert(region, *block);
+    }
+    usedblock->type = HimemAlloc::Block::Type::USED;
+    usedblock->addr = (char *)target;
+    usedblock->size = size;
+    region.free_size -= size;
+    region.n_used++;
+    addr = (char *)target;
+    return usedblock;
+}
+
+/** Give a block back, merging it with both of its neighbours */
+static void mem_release(HimemAlloc::Region &region, HimemAlloc::Block &block)
+{
+    region.free_size += block.size;
+    region.n_used--;
+    block.type = HimemAlloc::Block::Type::FREE;
 
-            if (block->type != HimemAlloc::Block::Type::FREE && !(block->size >= size))
-            {
-                ptr += block->size;
-                block = block->next;
-                continue;
-            }
+    auto *next = block.next, *prev = block.prev;
+    if (next != nullptr && next->type == HimemAlloc::Block::Type::FREE)
+    {
+        mem_bin_remove(region, *next);
+        block.size += next->size;
+        mem_drop_block(region, *next);
+    }
+
+    if (prev != nullptr && prev->type == HimemAlloc::Block::Type::FREE)
+    {
+        mem_bin_remove(region, *prev);
+        prev->size += block.size;
+        mem_drop_block(region, block);
+        mem_bin_insert(region, *prev);
+        return;
+    }
+    mem_bin_insert(region, block);
+}
+
+/** Obtain the descriptor of a block allocation, nullptr if ptr isn't one */
+static inline HimemAlloc::Block *mem_lookup(void *ptr)
+{
+    auto *header = (BlockHeader *)ptr - 1;
+    if (header->magic != BLOCK_MAGIC || header->block->type != HimemAlloc::Block::Type::USED)
+    {
+        TTY::Print("himem: %p is not an allocation\n", ptr);
+        return nullptr;
+    }
+    return header->block;
+}
+
+static inline void *mem_payload(HimemAlloc::Region &region, HimemAlloc::Block &block, char *addr)
+{
+    auto *header = (BlockHeader *)addr;
+    header->region = &region;
+    header->block = &block;
+    header->magic = BLOCK_MAGIC;
+    return header + 1;
+}
 
-            HimemAlloc::Block *newblock;
-            if ((newblock = HimemAlloc::AddBlock(region)) == nullptr)
-                return nullptr;
+/* Bookkeeping of the stats, slab objects are counted on their size class
+ * and blocks on the last one */
+static inline void mem_count_alloc(HimemAlloc::Manager &master, size_t size, unsigned size_class)
+{
+    auto &stats = master.stats;
+    stats.in_use += size;
+    if (stats.in_use > stats.peak)
+        stats.peak = stats.in_use;
+    stats.n_allocs++;
+    stats.live[size_class]++;
+}
 
-            newblock->type = HimemAlloc::Block::Type::USED;
+static inline void mem_count_free(HimemAlloc::Manager &master, size_t size, unsigned size_class)
+{
+    auto &stats = master.stats;
+    stats.in_use -= size;
+    stats.n_frees++;
+    stats.live[size_class]--;
+}
+
+/** Allocate memory of specified size from the blocks of a region */
+static void *mem_alloc(HimemAlloc::Manager &master, HimemAlloc::Region &region, size_t size, size_t align)
+{
+    char *addr;
+    size = mem_block_size(size);
+    if (region.free_size < size)
+        return nullptr;
 
-            /* Parenting - VERY IMPORTANT! */
-            newblock->next = block->next;
-            block->next = newblock;
+    if (align < alignof(BlockHeader))
+        align = alignof(BlockHeader);
+    auto *block = mem_carve(region, size, align, sizeof(BlockHeader), addr);
+    if (block == nullptr)
+        return nullptr;
+    mem_count_alloc(master, block->size, SLAB_NUM_CLASSES);
+    return mem_payload(region, *block, addr);
+}
 
-            newblock->size = size;
-            block->size -= size;
-            region.free_size -= size;
+/* Header placed right before every object of an arena, in place of the
+ * BlockHeader so Free and Realloc can tell them apart */
+struct ArenaHeader
+{
+    size_t size;
+    ArenaHeader *prev; // Header of the object allocated before on the arena
+    uintptr_t magic;
+} __attribute__((aligned(16)));
+#define ARENA_MAGIC 0x41524E41 // "ARNA"
+static_assert(sizeof(ArenaHeader) == sizeof(BlockHeader) && offsetof(ArenaHeader, magic) == offsetof(BlockHeader, magic));
+
+/* Chunks of an arena, taken from the blocks of the manager */
+struct ArenaChunk
+{
+    ArenaChunk *next;
+    size_t size;
+} __attribute__((aligned(16)));
 
-            ptr += block->size;
+static inline bool mem_is_arena(void *ptr)
+{
+    return ((ArenaHeader *)ptr - 1)->magic == ARENA_MAGIC;
+}
+
+/** Free previously allocated memory from the blocks of a region */
+static void mem_free(HimemAlloc::Manager &master, HimemAlloc::Region &region, void *ptr)
+{
+    /* Objects of arenas go away with the arena */
+    if (mem_is_arena(ptr))
+        return;
+
+    auto *block = mem_lookup(ptr);
+    if (block == nullptr)
+        return;
+    ((BlockHeader *)ptr - 1)->magic = 0;
+    mem_count_free(master, block->size, SLAB_NUM_CLASSES);
+    mem_release(region, *block);
+}
+
+/** Reallocate previously allocated memory from the blocks of a region */
+static void *mem_realloc(HimemAlloc::Manager &master, HimemAlloc::Region &region, void *ptr, size_t size)
+{
+    /* Objects of arenas can't grow in place, they move to the blocks */
+    if (mem_is_arena(ptr))
+    {
+        size_t old_size = ((ArenaHeader *)ptr - 1)->size;
+        void *new_ptr = HimemAlloc::Alloc(master, size);
+        if (new_ptr != nullptr)
+            memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+        return new_ptr;
+    }
+
+    auto *block = mem_lookup(ptr);
+    if (block == nullptr)
+        return nullptr;
+
+    char *bptr = (char *)ptr - sizeof(BlockHeader);
+    size_t new_size = mem_block_size(size);
+    /* Expand */
+    if (new_size > block->size)
+    {
+        size_t diff = new_size - block->size;
+        auto *next = block->next, *prev = block->prev;
+        /* Take size from next block */
+        if (next != nullptr && next->type == HimemAlloc::Block::Type::FREE && next->size >= diff)
+        {
+            mem_bin_remove(region, *next);
+            block->size += diff;
+            next->addr += diff;
+            next->size -= diff;
+            region.free_size -= diff;
+            master.stats.in_use += diff;
+            if (next->size == 0)
+                mem_drop_block(region, *next);
+            else
+                mem_bin_insert(region, *next);
             return ptr;
         }
+        /* Take size from previous block, the contents move down */
+        else if (prev != nullptr && prev->type == HimemAlloc::Block::Type::FREE && prev->size >= diff)
+        {
+            memmove(bptr - diff, bptr, block->size);
+            mem_bin_remove(region, *prev);
+            block->addr -= diff;
+            block->size += diff;
+            prev->size -= diff;
+            region.free_size -= diff;
+            master.stats.in_use += diff;
+            if (prev->size == 0)
+                mem_drop_block(region, *prev);
+            else
+                mem_bin_insert(region, *prev);
+            return mem_payload(region, *block, bptr - diff);
+        }
+
+        /* If the method above fails; we will do a malloc and then
+         * free the old block */
+        void *new_ptr;
+        new_ptr = HimemAlloc::Alloc(master, size);
+        if (new_ptr == nullptr)
+            return nullptr;
+
+        memcpy(new_ptr, ptr, block->size - sizeof(BlockHeader));
+        mem_free(master, region, ptr);
+        return new_ptr;
     }
-    return nullptr;
+    /* Shrink */
+    else if (block->size - new_size >= BLOCK_MIN_SIZE)
+    {
+        size_t diff = block->size - new_size;
+        /* Give size to block after */
+        auto *next = block->next;
+        if (next != nullptr && next->type == HimemAlloc::Block::Type::FREE)
+        {
+            mem_bin_remove(region, *next);
+            next->addr -= diff;
+            next->size += diff;
+            mem_bin_insert(region, *next);
+            block->size -= diff;
+            region.free_size += diff;
+            master.stats.in_use -= diff;
+            return ptr;
+        }
+
+        /* Create (split) block with remainder size after the block */
+        auto *new_block = HimemAlloc::AddBlock(region);
+        if (new_block == nullptr)
+            return ptr;
+
+        new_block->type = HimemAlloc::Block::Type::FREE;
+        new_block->addr = block->addr + block->size - diff;
+        new_block->size = diff;
+        mem_link_after(*block, *new_block);
+        mem_bin_insert(region, *new_block);
+        block->size -= diff;
+        region.free_size += diff;
+        master.stats.in_use -= diff;
+        return ptr;
+    }
+    /* No change - no reallocation :D */
+    return ptr;
+}
+
+/** Obtain the size class for an object of the given size */
+static inline unsigned slab_size_class(size_t size)
+{
+    if (size <= SLAB_MIN_SIZE)
+        return 0;
+    return std::bit_width(size - 1) - std::bit_width(static_cast<size_t>(SLAB_MIN_SIZE - 1));
+}
+
+/** Obtain the slab descriptor of the page holding ptr, nullptr if the page
+ * belongs to the block allocator */
+static inline HimemAlloc::Slab *slab_lookup(HimemAlloc::Region &region, const void *ptr)
+{
+    auto &slab = region.pages[((const char *)ptr - region.page_base) / PAGE_SIZE];
+    return slab.n_total ? &slab : nullptr;
+}
+
+static inline void slab_link(HimemAlloc::SlabCache &cache, HimemAlloc::Slab &slab)
+{
+    slab.prev = nullptr;
+    slab.next = cache.partial;
+    if (cache.partial != nullptr)
+        cache.partial->prev = &slab;
+    cache.partial = &slab;
+}
+
+static inline void slab_unlink(HimemAlloc::SlabCache &cache, HimemAlloc::Slab &slab)
+{
+    if (slab.prev != nullptr)
+        slab.prev->next = slab.next;
+    else
+        cache.partial = slab.next;
+    if (slab.next != nullptr)
+        slab.next->prev = slab.prev;
+    slab.next = slab.prev = nullptr;
+}
+
+/** Take a page from the block allocator and carve it into objects */
+static HimemAlloc::Slab *slab_new(HimemAlloc::Manager &master, unsigned size_class)
+{
+    auto &cache = master.slabs[size_class];
+    char *page = nullptr;
+    HimemAlloc::Block *block = nullptr;
+    auto *region = mem_find_if(master, [&](auto &region) {
+        return region.free_size >= PAGE_SIZE
+            && (block = mem_carve(region, PAGE_SIZE, PAGE_SIZE, 0, page)) != nullptr;
+    });
+    if (region == nullptr)
+        return nullptr;
+
+    auto &slab = region->pages[(page - region->page_base) / PAGE_SIZE];
+    slab.addr = page;
+    slab.block = block;
+    slab.size_class = size_class;
+    slab.n_total = PAGE_SIZE / cache.obj_size;
+    slab.n_free = slab.n_total;
+    slab.free_list = nullptr;
+    /* Thread in reverse so the objects are handed out in address order */
+    for (size_t j = slab.n_total; j-- > 0; )
+    {
+        auto **obj = (void **)(page + j * cache.obj_size);
+        *obj = slab.free_list;
+        slab.free_list = obj;
+    }
+    cache.n_slabs++;
+    cache.n_free += slab.n_total;
+    slab_link(cache, slab);
+    return &slab;
+}
+
+static void *slab_alloc(HimemAlloc::Manager &master, unsigned size_class)
+{
+    auto &cache = master.slabs[size_class];
+    if (cache.quick != nullptr)
+    {
+        void *obj = cache.quick;
+        cache.quick = *(void **)obj;
+        cache.n_quick--;
+        cache.n_free--;
+        mem_count_alloc(master, cache.obj_size, size_class);
+        return obj;
+    }
+
+    auto *slab = cache.partial;
+    if (slab == nullptr && (slab = slab_new(master, size_class)) == nullptr)
+        return nullptr;
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->n_free--;
+    cache.n_free--;
+    /* Full slabs are not tracked, they'll come back on the first free */
+    if (slab->n_free == 0)
+        slab_unlink(cache, *slab);
+    mem_count_alloc(master, cache.obj_size, size_class);
+    return obj;
+}
+
+static void slab_free(HimemAlloc::Manager &master, HimemAlloc::Region &region, HimemAlloc::Slab &slab, void *ptr)
+{
+    auto &cache = master.slabs[slab.size_class];
+    mem_count_free(master, cache.obj_size, slab.size_class);
+    *(void **)ptr = slab.free_list;
+    slab.free_list = ptr;
+    if (slab.n_free++ == 0)
+        slab_link(cache, slab);
+    cache.n_free++;
+
+    /* Give wholly free pages back to the blocks, but always keep one page
+     * per class so alloc/free pairs don't thrash the block allocator */
+    if (slab.n_free == slab.n_total && (slab.prev != nullptr || slab.next != nullptr))
+    {
+        slab_unlink(cache, slab);
+        cache.n_slabs--;
+        cache.n_free -= slab.n_total;
+        slab.n_total = 0;
+        mem_release(region, *slab.block);
+    }
+}
+
+/** Make a new region big enough for a block of size bytes */
+static HimemAlloc::Region *mem_grow(HimemAlloc::Manager &master, size_t size)
+{
+    if (master.grow == nullptr)
+        return nullptr;
+
+    /* Find a manager with room for the region, or chain a new one */
+    HimemAlloc::Manager *manager = &master, *last = nullptr;
+    for (; manager != nullptr; last = manager, manager = manager->next)
+    {
+        size_t i = 0;
+        while (i < manager->max_regions && manager->regions[i].addr != nullptr)
+            i++;
+        if (i < manager->max_regions)
+            break;
+    }
+
+    /* Leave room for the descriptors of the region and for the alignment
+     * of the block */
+    size_t chain_size = (sizeof(HimemAlloc::Manager) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    size += size / 64 + 4 * PAGE_SIZE;
+    if (manager == nullptr)
+        size += chain_size;
+
+    size_t mem_size = size;
+    void *mem_base = master.grow(mem_size);
+    if (mem_base == nullptr)
+        return nullptr;
+
+    char *addr = (char *)mem_base;
+    if (manager == nullptr)
+    {
+        manager = new (mem_base) HimemAlloc::Manager();
+        HimemAlloc::InitManager(*manager);
+        last->next = manager;
+        addr += chain_size;
+    }
+
+    auto *region = HimemAlloc::AddRegion(*manager, addr, mem_size - (addr - (char *)mem_base));
+    if (region == nullptr)
+    {
+        if (master.release != nullptr)
+            master.release(mem_base, mem_size);
+        return nullptr;
+    }
+    region->mem_base = mem_base;
+    region->mem_size = mem_size;
+    return region;
+}
+
+/** Give a region that's all free back to the release handler, as long as the
+ * other regions still have more free memory than the low-water mark */
+static void mem_shrink(HimemAlloc::Manager &master, HimemAlloc::Region &region)
+{
+    mem_trim_blocks(region);
+    if (master.release == nullptr || region.mem_base == nullptr || region.n_used != 0)
+        return;
+
+    size_t free_size = 0;
+    mem_find_if(master, [&](auto &other) {
+        if (&other != &region)
+            free_size += other.free_size;
+        return false;
+    });
+    if (free_size < master.low_water)
+        return;
+
+    /* The region may be holding the manager it's on, which can then only go
+     * away once it has no other regions */
+    HimemAlloc::Manager *manager = &master, *prev = nullptr;
+    while (&region < &manager->regions[0] || &region >= &manager->regions[manager->max_regions])
+    {
+        prev = manager;
+        manager = manager->next;
+    }
+
+    if ((void *)manager == region.mem_base)
+    {
+        for (size_t i = 0; i < manager->max_regions; i++)
+            if (&manager->regions[i] != &region && manager->regions[i].addr != nullptr)
+                return;
+        prev->next = manager->next;
+    }
+
+    void *mem_base = region.mem_base;
+    size_t mem_size = region.mem_size;
+    region.addr = nullptr;
+    region.mem_base = nullptr;
+    master.release(mem_base, mem_size);
+}
+
+/** Allocate memory of specified size */
+void *HimemAlloc::Alloc(HimemAlloc::Manager &master, size_t size)
+{
+    MEM_LOCK(master);
+    void *ptr;
+    if (size <= SLAB_MAX_SIZE && (ptr = slab_alloc(master, slab_size_class(size))) != nullptr)
+        return ptr;
+
+    if (mem_find_if(master, [&](auto &region) { return (ptr = mem_alloc(master, region, size, 0)) != nullptr; }))
+        return ptr;
+
+    auto *region = mem_grow(master, mem_block_size(size));
+    if (region == nullptr || (ptr = mem_alloc(master, *region, size, 0)) == nullptr)
+    {
+        master.stats.n_failed++;
+        return nullptr;
+    }
+    return ptr;
 }
 
 /** Free previously allocated memory */
 void HimemAlloc::Free(HimemAlloc::Manager &master, void *ptr)
 {
-    for (size_t i = 0; i < master.max_regions; i++)
+    MEM_LOCK(master);
+    if (ptr == nullptr)
+        return;
+
+    auto *region = mem_find_region(master, ptr);
+    if (region == nullptr)
+        return;
+
+    auto *slab = slab_lookup(*region, ptr);
+    if (slab != nullptr)
+        slab_free(master, *region, *slab, ptr);
+    else
+        mem_free(master, *region, ptr);
+    mem_shrink(master, *region);
+}
+
+/** Free memory of a known size and alignment. Only blocks and arena objects
+ * are bigger than the slabs take, their header can be read straight away.
+ * Anything else may sit on a slab page, where the words before it belong to
+ * the object before, so the page descriptor decides and slab objects go on
+ * the quick list of their class. Only a full quick list falls back to
+ * slab_free */
+void HimemAlloc::SizedFree(HimemAlloc::Manager &master, void *ptr, size_t size, size_t align)
+{
+    MEM_LOCK(master);
+    if (ptr == nullptr)
+        return;
+
+    auto *header = (BlockHeader *)ptr - 1;
+    if ((size > SLAB_MAX_SIZE || align > SLAB_MAX_SIZE) && header->magic == BLOCK_MAGIC)
     {
-        auto &region = master.regions[i];
-        char *bptr = region.addr;
-        /* While we recurse we will also take the opportunity to
-         * merge free blocks */
-        HimemAlloc::Block *block = region.head, *prev = nullptr;
-        while (block != nullptr)
-        {
-            mem_fix_block(*block);
-
-            if (block->type == HimemAlloc::Block::Type::USED && bptr >= ptr && ptr <= bptr + block->size)
-            {
-                if (prev != nullptr && prev->type == HimemAlloc::Block::Type::FREE)
-                {
-                    prev->next = block->next;
-                    prev->size += block->size;
-                    block->type = HimemAlloc::Block::Type::NOT_PRESENT;
-                }
-                else
-                {
-                    block->type = HimemAlloc::Block::Type::FREE;
-                }
-                return;
-            }
+        auto &region = *header->region;
+        mem_free(master, region, ptr);
+        mem_shrink(master, region);
+        return;
+    }
 
-            bptr += block->size;
+    auto *region = mem_find_region(master, ptr);
+    if (region == nullptr)
+        return;
 
-            prev = block;
-            block = block->next;
-        }
+    auto *slab = slab_lookup(*region, ptr);
+    if (slab == nullptr)
+    {
+        mem_free(master, *region, ptr);
+        mem_shrink(master, *region);
+        return;
+    }
+
+    auto &cache = master.slabs[slab->size_class];
+    if (cache.n_quick < SLAB_QUICK_MAX)
+    {
+        *(void **)ptr = cache.quick;
+        cache.quick = ptr;
+        cache.n_quick++;
+        cache.n_free++;
+        mem_count_free(master, cache.obj_size, slab->size_class);
+        return;
     }
+    slab_free(master, *region, *slab, ptr);
+    mem_shrink(master, *region);
 }
 
 /** Allocate memory with align constraint */
 void *HimemAlloc::AlignAlloc(HimemAlloc::Manager &master, size_t size, size_t align)
 {
-    for (size_t i = 0; i < master.max_regions; i++)
+    MEM_LOCK(master);
+    void *ptr;
+    /* Objects are aligned to their size class since slabs are page aligned */
+    if (size <= SLAB_MAX_SIZE && align <= SLAB_MAX_SIZE
+            && (ptr = slab_alloc(master, slab_size_class(size > align ? size : align))) != nullptr)
+        return ptr;
+
+    if (mem_find_if(master, [&](auto &region) { return (ptr = mem_alloc(master, region, size, align)) != nullptr; }))
+        return ptr;
+
+    auto *region = mem_grow(master, mem_block_size(size) + align);
+    if (region == nullptr || (ptr = mem_alloc(master, *region, size, align)) == nullptr)
     {
-        auto &region = master.regions[i];
-        if (region.addr == nullptr || region.free_size < size)
-            continue;
-
-        auto *block = region.head;
-        char *bptr = region.addr;
-        while (block != nullptr)
-        {
-            uintptr_t pbptr = (uintptr_t)bptr;
-            if (block->type == HimemAlloc::Block::Type::FREE && block->size >= size + ((uintptr_t)pbptr % align))
-            {
-                uintptr_t target;
-                /* Perfect match! (very unlikely) */
-                if (!(uintptr_t)pbptr % align)
-                {
-                    /* If size is bigger split block into free and used parts */
-                    if (block->size >= align)
-                    {
-                        /* New block AFTER this used block */
-
-                        // TODO: Make block be BEFORE this used block (for speed reasons)
-                        HimemAlloc::Block *newblock;
-                        newblock = HimemAlloc::AddBlock(region);
-                        if (newblock == nullptr)
-                            return nullptr;
-
-                        block->type = HimemAlloc::Block::Type::USED;
-                        newblock->next = block->next;
-                        block->next = newblock;
-
-                        newblock->size = block->size - size;
-                        block->size = size;
-                        return bptr;
-                    }
-                    /* Astronomically impossible: the perfectest match, aligned and
-                     * with same size */
-                    else if (block->size == size)
-                    {
-                        block->type = HimemAlloc::Block::Type::USED;
-                        return bptr;
-                    }
-                }
-                /* Block sufficiently big */
-                else
-                {
-                    target = pbptr + block->size;
-                    target -= align;
-                    target -= target % align;
-
-                    uintptr_t off = target - pbptr;
-
-                    /* First check if we should make  afree part AFTER this block (a free part) */
-                    if (off + size > block->size)
-                    {
-                        HimemAlloc::Block *afterblock;
-                        afterblock = HimemAlloc::AddBlock(region);
-                        if (afterblock == nullptr)
-                            return nullptr;
-                        afterblock->size = block->size - (off + size);
-                        afterblock->type = HimemAlloc::Block::Type::FREE;
-
-                        afterblock->next = block->next;
-                        block->next = afterblock;
-                        block->size -= afterblock->size;
-                    }
-
-                    // TODO: Assert off != 0
-
-                    /* Make block BEFORE this block (also a free part) */
-                    HimemAlloc::Block *usedblock;
-                    usedblock = HimemAlloc::AddBlock(region);
-                    if (usedblock == nullptr)
-                        return nullptr;
-                    block->size = off;
-                    usedblock->size = size;
-                    usedblock->type = HimemAlloc::Block::Type::USED;
-
-                    usedblock->next = block->next;
-                    block->next = usedblock;
-
-                    // TODO: Implement after eating pizza
-                    return (void *)(pbptr + block->size);
-                }
-            }
-            bptr += block->size;
-        }
+        master.stats.n_failed++;
+        return nullptr;
     }
-    return nullptr;
+    return ptr;
 }
 
 /** Reallocate previously allocated memory */
 void *HimemAlloc::Realloc(HimemAlloc::Manager &master, void *ptr, size_t size)
 {
-    char *bptr;
-    for (size_t i = 0; i < master.max_regions; i++)
+    MEM_LOCK(master);
+    if (ptr == nullptr)
+        return HimemAlloc::Alloc(master, size);
+
+    auto *region = mem_find_region(master, ptr);
+    if (region == nullptr)
+        return nullptr;
+
+    auto *slab = slab_lookup(*region, ptr);
+    if (slab == nullptr)
     {
-        auto &region = master.regions[i];
-        HimemAlloc::Block *block, *prev;
-        if (region.addr == nullptr || region.free_size < size)
-            continue;
-        bptr = region.addr;
-        block = region.head;
-        prev = nullptr;
-        while (block != nullptr)
-        {
-            mem_fix_block(*block);
-
-            /* Find block - if possible take space from next free block.
-             * Otherwise do a allocation and then free. */
-            if (block->type == HimemAlloc::Block::Type::USED && bptr >= ptr && ptr <= bptr + block->size)
-            {
-                size_t diff;
-
-                diff = size - block->size;
-
-                /* Expand */
-                if ((ssize_t)diff > 0)
-                {
-                    /* Take size from next block */
-                    if (block->next != nullptr && block->next->type == HimemAlloc::Block::Type::FREE && block->next->size >= diff)
-                    {
-                        block->size += diff;
-                        block->next->size -= diff;
-                        region.free_size -= diff;
-                        return bptr;
-                    }
-                    /* Take size from previous block */
-                    else if (prev != nullptr && prev->type == HimemAlloc::Block::Type::FREE && prev->size >= diff)
-                    {
-                        block->size += diff;
-                        prev->size -= diff;
-                        region.free_size -= diff;
-                        return bptr - diff;
-                    }
-                    /* If the method above fails; we will do a malloc and then
-                     * free the old block */
-                    else
-                    {
-                        void *new_ptr;
-                        new_ptr = HimemAlloc::Alloc(master, size);
-                        if (new_ptr == nullptr)
-                            return nullptr;
-
-                        memcpy(new_ptr, ptr, block->size);
-                        HimemAlloc::Free(master, ptr);
-                        return new_ptr;
-                    }
-                }
-                /* Shrink */
-                else if ((ssize_t)diff < 0)
-                {
-                    diff = -diff;
-
-                    /* Give size to block before */
-                    if (prev != nullptr && prev->type == HimemAlloc::Block::Type::FREE)
-                    {
-                        prev->size += diff;
-                        block->size -= diff;
-                        region.free_size += diff;
-                        return bptr + diff;
-                    }
-                    /* Give size to block after */
-                    else if (block->next != nullptr && block->next->type == HimemAlloc::Block::Type::FREE)
-                    {
-                        block->next->size += diff;
-                        block->size -= diff;
-                        region.free_size += diff;
-                        return bptr;
-                    }
-                    /* Create (split) block with remainder size. We will put it after
-                     * the block for simplicity */
-                    // TODO: We must do it BEFORE block; because that reduces fragmentation
-                    // remember that all free blocks are guaranteed to be at the left
-                    else
-                    {
-                        auto *new_block = HimemAlloc::AddBlock(region);
-                        if (new_block == nullptr)
-                            return nullptr;
-
-                        new_block->type = HimemAlloc::Block::Type::FREE;
-                        new_block->size = diff;
-                        block->size -= diff;
-                        region.free_size += diff;
-                        return bptr;
-                    }
-                }
-                /* No change - no reallocation :D */
-                else
-                {
-                    return bptr;
-                }
-            }
-
-            bptr += block->size;
-            prev = block;
-            block = block->next;
-        }
+        ptr = mem_realloc(master, *region, ptr, size);
+        mem_shrink(master, *region);
+        return ptr;
     }
 
-    /* This only happens when */
-    bptr = (char *)HimemAlloc::Alloc(master, size);
-    return nullptr;
+    /* Stay on the same object if the size class doesn't change */
+    size_t obj_size = master.slabs[slab->size_class].obj_size;
+    if (size <= obj_size && slab_size_class(size) == slab->size_class)
+        return ptr;
+
+    void *new_ptr = HimemAlloc::Alloc(master, size);
+    if (new_ptr == nullptr)
+        return nullptr;
+    memcpy(new_ptr, ptr, size < obj_size ? size : obj_size);
+    slab_free(master, *region, *slab, ptr);
+    mem_shrink(master, *region);
+    return new_ptr;
 }
 
 HimemAlloc::Info HimemAlloc::GetInfo(const HimemAlloc::Manager& master)
 {
+    MEM_LOCK_SHARED(master);
     HimemAlloc::Info info{};
-    for (size_t i = 0; i < master.max_regions; i++)
-    {
-        const auto& region = master.regions[i];
-        if (region.addr == nullptr)
-            continue;
-
+    size_t largest = 0;
+    mem_find_if(master, [&](const auto &region) {
         auto *block = region.head;
         while (block != nullptr)
         {
@@ -546,20 +1354,54 @@ HimemAlloc::Info HimemAlloc::GetInfo(const HimemAlloc::Manager& master)
             info.total += block->size;
             block = block->next;
         }
+
+        /* The largest free block is on the highest bin in use */
+        if (region.bin_map != 0)
+            for (block = region.bins[std::bit_width(region.bin_map) - 1]; block != nullptr; block = block->free_next)
+                if (block->size > largest)
+                    largest = block->size;
+        return false;
+    });
+
+    if (info.free != 0)
+        info.fragmentation = 100 - largest * 100 / info.free;
+    info.largest_free = largest > sizeof(BlockHeader) ? largest - sizeof(BlockHeader) : 0;
+
+    /* Slab pages are USED blocks, but their free objects are free memory */
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++)
+    {
+        const auto &cache = master.slabs[i];
+        info.slab += cache.n_slabs * PAGE_SIZE;
+        info.free += cache.n_free * cache.obj_size;
     }
     return info;
 }
 
-void HimemAlloc::Print(const HimemAlloc::Manager& master)
+/** Obtain the counters of a manager, only the regions are looked at so
+ * it's cheap enough to be called every frame */
+HimemAlloc::Stats HimemAlloc::GetStats(const HimemAlloc::Manager& master)
 {
-    TTY::Print("master has max. %u regions\n", master.max_regions);
-    for (size_t i = 0; i < master.max_regions; i++)
-    {
-        auto& region = master.regions[i];
-        if (region.addr == nullptr)
-            continue;
+    MEM_LOCK_SHARED(master);
+    HimemAlloc::Stats stats = master.stats;
+    stats.total = stats.free = 0;
+    mem_find_if(master, [&](const auto &region) {
+        stats.total += region.size;
+        stats.free += region.free_size;
+        return false;
+    });
+    for (size_t i = 0; i < SLAB_NUM_CLASSES; i++)
+        stats.free += master.slabs[i].n_free * master.slabs[i].obj_size;
+    return stats;
+}
 
-        TTY::Print("Region#%u, size %u, maxBlocks %u, free %u, totalSize %u\n", i, region.size, region.max_blocks, region.free_size, region.size);
+void HimemAlloc::Print(const HimemAlloc::Manager& master)
+{
+    MEM_LOCK_SHARED(master);
+    size_t i = 0;
+    for (auto *manager = &master; manager != nullptr; manager = manager->next)
+        TTY::Print("master has max. %u regions\n", manager->max_regions);
+    mem_find_if(master, [&i](const auto &region) {
+        TTY::Print("Region#%u, size %u, maxBlocks %u, free %u, totalSize %u\n", i++, region.size, region.max_blocks, region.free_size, region.size);
 
         auto *block = region.head;
         while (block != nullptr)
@@ -567,28 +1409,196 @@ void HimemAlloc::Print(const HimemAlloc::Manager& master)
             TTY::Print("%s %u\n", (block->type == HimemAlloc::Block::Type::FREE) ? "FREE" : "USED", block->size);
             block = block->next;
         }
+        return false;
+    });
+
+    for (i = 0; i < SLAB_NUM_CLASSES; i++)
+    {
+        auto &cache = master.slabs[i];
+        if (cache.n_slabs)
+            TTY::Print("Slab %u: %u pages, free %u/%u\n", cache.obj_size, cache.n_slabs, cache.n_free, cache.n_slabs * (PAGE_SIZE / cache.obj_size));
+    }
+}
+
+void HimemAlloc::InitArena(HimemAlloc::Arena &arena, HimemAlloc::Manager &master)
+{
+    arena.master = &master;
+    arena.ptr = arena.end = nullptr;
+    arena.chunks = nullptr;
+    arena.last = nullptr;
+    arena.used = 0;
+    arena.suspended = 0;
+}
+
+/** Allocate from an arena by bumping a pointer, objects too big for a chunk
+ * get one of their own */
+void *HimemAlloc::ArenaAlloc(HimemAlloc::Arena &arena, size_t size, size_t align)
+{
+    if (align < alignof(ArenaHeader))
+        align = alignof(ArenaHeader);
+
+    auto align_up = [align](char *p) {
+        return (char *)(((uintptr_t)p + sizeof(ArenaHeader) + align - 1) & ~(uintptr_t)(align - 1));
+    };
+    bool own = false;
+    char *obj = arena.ptr != nullptr ? align_up(arena.ptr) : nullptr;
+    if (obj == nullptr || obj + size > arena.end)
+    {
+        size_t chunk_size = sizeof(ArenaChunk) + sizeof(ArenaHeader) + size + align;
+        own = chunk_size > ARENA_CHUNK_SIZE / 4;
+        if (!own)
+            chunk_size = ARENA_CHUNK_SIZE;
+
+        auto *chunk = (ArenaChunk *)HimemAlloc::Alloc(*arena.master, chunk_size);
+        if (chunk == nullptr)
+            return nullptr;
+        chunk->next = (ArenaChunk *)arena.chunks;
+        chunk->size = chunk_size;
+        arena.chunks = chunk;
+
+        obj = align_up((char *)(chunk + 1));
+        if (!own)
+            arena.end = (char *)chunk + chunk_size;
     }
+
+    auto *header = (ArenaHeader *)obj - 1;
+    header->size = size;
+    header->prev = (ArenaHeader *)arena.last;
+    header->magic = ARENA_MAGIC;
+    arena.last = header;
+    if (!own)
+        arena.ptr = obj + size;
+    arena.used += size;
+    return obj;
+}
+
+/** Whether an object was allocated from the arena */
+bool HimemAlloc::ArenaOwns(const HimemAlloc::Arena &arena, const void *ptr)
+{
+    for (auto *chunk = (const ArenaChunk *)arena.chunks; chunk != nullptr; chunk = chunk->next)
+        if ((const char *)ptr >= (const char *)chunk && (const char *)ptr < (const char *)chunk + chunk->size)
+            return true;
+    return false;
+}
+
+/** Give back every chunk of an arena, its objects must no longer be used */
+void HimemAlloc::ReleaseArena(HimemAlloc::Arena &arena)
+{
+    /* The chunks go back to the blocks, a header left behind would make Free
+     * take whatever is allocated there later for an arena object */
+    for (auto *header = (ArenaHeader *)arena.last; header != nullptr; header = header->prev)
+        header->magic = 0;
+
+    auto *chunk = (ArenaChunk *)arena.chunks;
+    while (chunk != nullptr)
+    {
+        auto *next = chunk->next;
+        HimemAlloc::Free(*arena.master, chunk);
+        chunk = next;
+    }
+    arena.ptr = arena.end = nullptr;
+    arena.chunks = nullptr;
+    arena.last = nullptr;
+    arena.used = 0;
+}
+
+/* Everything below needs the tasks, tools/allocbench builds the allocator
+ * for the host with HIMEM_HOSTED and leaves it out */
+#ifndef HIMEM_HOSTED
+HimemAlloc::ArenaSuspend::ArenaSuspend()
+{
+    auto *task = Task::PeekCurrent();
+    this->arena = task != nullptr ? task->arena : nullptr;
+    if (this->arena != nullptr)
+        this->arena->suspended++;
+}
+
+HimemAlloc::ArenaSuspend::~ArenaSuspend()
+{
+    if (this->arena != nullptr)
+        this->arena->suspended--;
+}
+
+#ifdef HIMEM_TRACK_OWNERS
+static HimemAlloc::Site sites[HIMEM_MAX_SITES] = {};
+
+/** Charge an allocation to the current task and to its call site, sites past
+ * the table's capacity are counted on the last entry */
+static void mem_track(size_t size, const void *caller)
+{
+    MEM_LOCK(g_KMMaster);
+    // Allocations made before the first task are only charged to the site
+    if (auto *task = Task::PeekCurrent())
+    {
+        task->mem_allocs++;
+        task->mem_bytes += size;
+    }
+
+    size_t i = ((uintptr_t)caller >> 2) % (HIMEM_MAX_SITES - 1);
+    for (size_t n = 0; n < HIMEM_MAX_SITES - 1; n++, i = (i + 1) % (HIMEM_MAX_SITES - 1))
+        if (sites[i].caller == caller || sites[i].caller == nullptr)
+            break;
+    if (sites[i].caller != caller && sites[i].caller != nullptr)
+        i = HIMEM_MAX_SITES - 1;
+    else
+        sites[i].caller = caller;
+    sites[i].n_allocs++;
+    sites[i].bytes += size;
+}
+
+/** Copy the call sites that have allocated something */
+size_t HimemAlloc::GetSites(HimemAlloc::Site out[], size_t max)
+{
+    MEM_LOCK_SHARED(g_KMMaster);
+    size_t n = 0;
+    for (size_t i = 0; i < HIMEM_MAX_SITES && n < max; i++)
+        if (sites[i].n_allocs != 0)
+            out[n++] = sites[i];
+    return n;
+}
+#endif
+
+/** Allocations of a task with an arena come from the arena, the ones made
+ * before the first task is added come from the default manager */
+static inline void *mem_new(size_t size, size_t align, [[maybe_unused]] const void *caller)
+{
+#ifdef HIMEM_TRACK_OWNERS
+    mem_track(size, caller);
+#endif
+    void *ptr;
+    do
+    {
+        auto *task = Task::PeekCurrent();
+        auto *arena = task != nullptr ? task->arena : nullptr;
+        if (arena != nullptr && !arena->suspended)
+            ptr = HimemAlloc::ArenaAlloc(*arena, size, align);
+        else if (align)
+            ptr = HimemAlloc::AlignAlloc(g_KMMaster, size, align);
+        else
+            ptr = HimemAlloc::Alloc(g_KMMaster, size);
+    } while (ptr == nullptr && g_KMMaster.failure != nullptr && g_KMMaster.failure(size, align));
+    return ptr;
 }
 
 [[nodiscard]] void* operator new(std::size_t size)
 {
-    return HimemAlloc::Alloc(g_KMMaster, size);
+    return mem_new(size, 0, __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new(std::size_t size, std::align_val_t alignment)
 {
-    return HimemAlloc::AlignAlloc(g_KMMaster, size, static_cast<size_t>(alignment));
+    return mem_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new(std::size_t size, const std::nothrow_t&) noexcept
 {
-    return HimemAlloc::Alloc(g_KMMaster, size);
+    return mem_new(size, 0, __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new(std::size_t size, std::align_val_t alignment,
                                  const std::nothrow_t&) noexcept
 {
-    return HimemAlloc::AlignAlloc(g_KMMaster, size, static_cast<size_t>(alignment));
+    return mem_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
 }
 
 void  operator delete(void* ptr) noexcept
@@ -596,19 +1606,19 @@ void  operator delete(void* ptr) noexcept
     HimemAlloc::Free(g_KMMaster, ptr);
 }
 
-void  operator delete(void* ptr, std::size_t) noexcept
+void  operator delete(void* ptr, std::size_t size) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, size, 0);
 }
 
-void  operator delete(void* ptr, std::align_val_t) noexcept
+void  operator delete(void* ptr, std::align_val_t alignment) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, 0, static_cast<size_t>(alignment));
 }
 
-void  operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+void  operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, size, static_cast<size_t>(alignment));
 }
 
 void  operator delete(void* ptr, const std::nothrow_t&) noexcept
@@ -616,31 +1626,31 @@ void  operator delete(void* ptr, const std::nothrow_t&) noexcept
     HimemAlloc::Free(g_KMMaster, ptr);
 }
 
-void  operator delete(void* ptr, std::align_val_t,
+void  operator delete(void* ptr, std::align_val_t alignment,
                       const std::nothrow_t&) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, 0, static_cast<size_t>(alignment));
 }
 
 [[nodiscard]] void* operator new[](std::size_t size)
 {
-    return HimemAlloc::Alloc(g_KMMaster, size);
+    return mem_new(size, 0, __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new[](std::size_t size, std::align_val_t alignment)
 {
-    return HimemAlloc::AlignAlloc(g_KMMaster, size, static_cast<size_t>(alignment));
+    return mem_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
 {
-    return HimemAlloc::Alloc(g_KMMaster, size);
+    return mem_new(size, 0, __builtin_return_address(0));
 }
 
 [[nodiscard]] void* operator new[](std::size_t size, std::align_val_t alignment,
                                    const std::nothrow_t&) noexcept
 {
-    return HimemAlloc::AlignAlloc(g_KMMaster, size, static_cast<size_t>(alignment));
+    return mem_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
 }
 
 void  operator delete[](void* ptr) noexcept
@@ -648,19 +1658,19 @@ void  operator delete[](void* ptr) noexcept
     HimemAlloc::Free(g_KMMaster, ptr);
 }
 
-void  operator delete[](void* ptr, std::size_t) noexcept
+void  operator delete[](void* ptr, std::size_t size) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, size, 0);
 }
 
-void  operator delete[](void* ptr, std::align_val_t) noexcept
+void  operator delete[](void* ptr, std::align_val_t alignment) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, 0, static_cast<size_t>(alignment));
 }
 
-void  operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+void  operator delete[](void* ptr, std::size_t size, std::align_val_t alignment) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, size, static_cast<size_t>(alignment));
 }
 
 void  operator delete[](void* ptr, const std::nothrow_t&) noexcept
@@ -668,30 +1678,9 @@ void  operator delete[](void* ptr, const std::nothrow_t&) noexcept
     HimemAlloc::Free(g_KMMaster, ptr);
 }
 
-void  operator delete[](void* ptr, std::align_val_t,
+void  operator delete[](void* ptr, std::align_val_t alignment,
                         const std::nothrow_t&) noexcept
 {
-    HimemAlloc::Free(g_KMMaster, ptr);
-}
-
-#if 0
-[[nodiscard]] void* operator new  (std::size_t size, void*) noexcept
-{
-    return HimemAlloc::Alloc(g_KMMaster, size);
-}
-
-[[nodiscard]] void* operator new[](std::size_t size, void*) noexcept
-{
-    return HimemAlloc::Alloc(g_KMMaster, size);
-}
-
-void  operator delete  (void* ptr, void*) noexcept
-{
-    HimemAlloc::Free(g_KMMaster, ptr);
-}
-
-void  operator delete[](void* ptr, void*) noexcept
-{
-    HimemAlloc::Free(g_KMMaster, ptr);
+    HimemAlloc::SizedFree(g_KMMaster, ptr, 0, static_cast<size_t>(alignment));
 }
 #endif
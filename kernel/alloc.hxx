@@ -3,11 +3,15 @@
 
 #include <cstddef>
 #include <cstdint>
+#ifndef HIMEM_HOSTED
+#include "sync.hxx"
+#endif
 
 /// @brief Low memory allocator
 /// Allocates memory in the low address space so the DOS programs can run on
 /// the given addresses, this allocator is pretty simple and henceforth it uses
-/// a bitmap to track every allocation and a separate list of used blocks.
+/// a bitmap to track every allocation and a second one marking where each
+/// allocation starts.
 ///
 /// The allocator is NOT meant to be used by the OS for normal tasks, rather
 /// it's meant to be used when the OS needs to load v86 programs and requires
@@ -15,6 +19,8 @@
 /// switching into v8086 mode.
 namespace Alloc
 {
+#define LOW_ALLOC_SIZE 512 // Allocates in blocks of 512 bytes
+
 void AddUsedBlock(uintptr_t addr, size_t n_para);
 void SetBitmap(uint8_t bitmap[], size_t index, bool value);
 bool GetBitmap(uint8_t bitmap[], size_t index);
@@ -28,7 +34,13 @@ namespace HimemAlloc
 {
 #define PAGE_SIZE 4096
 #define DEFAULT_MAX_REGIONS 4
-#define DEFAULT_DESCRIPTORS_PER_BYTES 4096
+#define DEFAULT_LOW_WATER (256 * 1024) // Free bytes kept before regions are given back
+#define DEFAULT_INITIAL_BLOCKS 128 // Descriptors reserved by a new region, more are made on demand
+#define SLAB_MIN_SIZE 16   // Smallest size class of the slab allocator
+#define SLAB_MAX_SIZE 2048 // Largest size class, bigger goes to the blocks
+#define SLAB_NUM_CLASSES 8 // 16, 32, 64, 128, 256, 512, 1024, 2048
+#define SLAB_QUICK_MAX 32 // Objects of sized frees a size class keeps aside
+#define MEM_NUM_BINS (sizeof(size_t) * 8) // Free lists, one per power of two
 
 struct Block
 {
@@ -36,7 +48,11 @@ struct Block
     Block(Block &&) = delete;
     Block &operator=(const Block &) = delete;
 
-    struct Block *next;
+    struct Block *next; // Blocks are kept in address order
+    struct Block *prev;
+    struct Block *free_next; // Free list of the bin, only when FREE
+    struct Block *free_prev;
+    char *addr;
     size_t size;
     enum Type
     {
@@ -47,6 +63,34 @@ struct Block
     } type;
 };
 
+/// @brief A page carved into equally sized objects of a single size class
+/// the descriptors live out-of-band on the region, one per page, so the
+/// objects can use the whole page
+struct Slab
+{
+    Slab *next;
+    Slab *prev;
+    void *free_list; // Intrusive list of free objects on this page
+    char *addr;
+    HimemAlloc::Block *block; // Block of the page on the block allocator
+    uint16_t n_free;
+    uint16_t n_total; // 0 if the page isn't a slab
+    uint8_t size_class;
+};
+
+/// @brief Per size class cache of slabs that still have free objects
+struct SlabCache
+{
+    size_t obj_size = 0;
+    HimemAlloc::Slab *partial = nullptr;
+    size_t n_slabs = 0;
+    size_t n_free = 0; // Including the ones on the quick list
+    // Objects given back by sized frees, they stay taken on their slabs and
+    // are handed out again before those
+    void *quick = nullptr;
+    size_t n_quick = 0;
+};
+
 struct Region
 {
     Region() = default;
@@ -58,12 +102,48 @@ struct Region
     char *addr = nullptr;
     size_t free_size = 0;
     size_t size = 0;
+    void *mem_base = nullptr; // Memory given by the grow handler, nullptr if added by hand
+    size_t mem_size = 0;
     HimemAlloc::Block *head = nullptr;
+    size_t n_used = 0; // USED blocks, pages of descriptors included
     size_t max_blocks = 0;
     HimemAlloc::Block *blocks = nullptr;
+    HimemAlloc::Block *spare_blocks = nullptr; // List of NOT_PRESENT descriptors
+    HimemAlloc::Block *spare_tail = nullptr;
+    size_t n_spare_blocks = 0;
+    bool growing_blocks = false;
+    void *empty_pages = nullptr; // Pages of descriptors that are all spare
+    char *page_base = nullptr; // First page covered by the slab descriptors
+    size_t n_pages = 0;
+    HimemAlloc::Slab *pages = nullptr;
+    HimemAlloc::Block *bins[MEM_NUM_BINS] = {}; // Free blocks of [2^n, 2^(n+1)) bytes
+    size_t bin_map = 0; // Bit n set if bins[n] has blocks
 };
 
-// TODO: Do something when we run out of regions (make new regions)
+/// @brief Called when the regions are out of memory, returns memory for a new
+/// region of at least size bytes and sets size to what it actually gave
+using GrowHandler = void *(*)(size_t &size);
+/// @brief Takes back the memory of a region that's no longer needed
+using ReleaseHandler = void (*)(void *addr, size_t size);
+/// @brief Called when operator new can't get memory, returns true to retry
+using FailureHandler = bool (*)(size_t size, size_t align);
+
+/// @brief Counters of a manager, kept up to date by every allocation
+struct Stats
+{
+    size_t total = 0; // Bytes of the regions, filled by GetStats
+    size_t free = 0;  // Free bytes of the regions, filled by GetStats
+    size_t in_use = 0; // Bytes handed out, headers and size class rounding included
+    size_t peak = 0;
+    size_t n_allocs = 0;
+    size_t n_frees = 0;
+    size_t n_failed = 0;
+    size_t live[SLAB_NUM_CLASSES + 1] = {}; // Live objects per slab class, the last one counts blocks
+};
+
+/// @brief Set of regions, when they're all in use a new manager is placed at
+/// the start of the memory of the next region and chained through next. The
+/// slab caches and the handlers of the first manager are used for the chain
 struct Manager
 {
     Manager() = default;
@@ -75,6 +155,16 @@ struct Manager
     Manager *next = nullptr;
     size_t max_regions = 0;
     HimemAlloc::Region regions[DEFAULT_MAX_REGIONS] = {};
+    HimemAlloc::SlabCache slabs[SLAB_NUM_CLASSES] = {};
+    HimemAlloc::GrowHandler grow = nullptr;
+    HimemAlloc::ReleaseHandler release = nullptr;
+    HimemAlloc::FailureHandler failure = nullptr;
+    size_t low_water = DEFAULT_LOW_WATER;
+    HimemAlloc::Stats stats;
+#ifndef HIMEM_HOSTED
+    // Taken for writing by the allocations, for reading by the lookups
+    mutable Sync::RWLock lock;
+#endif
 
     static Manager& GetDefault();
 };
@@ -82,18 +172,74 @@ struct Manager
 int InitManager(Manager& master);
 HimemAlloc::Region *AddRegion(Manager& master, void *addr, size_t size);
 HimemAlloc::Block *AddBlock(Region &region);
+void DeleteBlock(Region &region, Block &block);
 void *Alloc(Manager &master, size_t size);
 void Free(Manager &master, void *ptr);
+void SizedFree(Manager &master, void *ptr, size_t size, size_t align);
 void *AlignAlloc(Manager &master, size_t size, size_t align);
 void *Realloc(Manager &master, void *ptr, size_t size);
 struct Info
 {
     size_t total = 0;
     size_t free = 0;
+    size_t slab = 0; // Bytes held by slab pages (free objects count as free)
+    size_t largest_free = 0; // Biggest allocation the blocks can still serve
+    unsigned fragmentation = 0; // Percent of free block memory not in the largest block
 };
 
 Info GetInfo(const HimemAlloc::Manager &master);
+Stats GetStats(const HimemAlloc::Manager &master);
+
+#ifdef HIMEM_TRACK_OWNERS
+#define HIMEM_MAX_SITES 64
+
+/// @brief Allocations of operator new made from a single place of the code,
+/// each task also counts the allocations it makes
+struct Site
+{
+    const void *caller = nullptr;
+    size_t n_allocs = 0;
+    size_t bytes = 0;
+};
+
+size_t GetSites(Site sites[], size_t max);
+#endif
 void Print(const HimemAlloc::Manager& master);
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/// @brief Bump allocator for the objects of a single program, freeing them is
+/// a no-op and they all go away at once with ReleaseArena. The memory comes
+/// in chunks from the blocks of a manager
+///
+/// A task with an arena set has all of its operator new served from it
+struct Arena
+{
+    Manager *master = nullptr;
+    char *ptr = nullptr; // Free space left on the current chunk
+    char *end = nullptr;
+    void *chunks = nullptr;
+    void *last = nullptr; // Newest object, each one links to the one before
+    size_t used = 0;
+    unsigned suspended = 0; // Allocations skip the arena while non-zero
+};
+
+void InitArena(Arena &arena, Manager &master);
+void *ArenaAlloc(Arena &arena, size_t size, size_t align);
+bool ArenaOwns(const Arena &arena, const void *ptr);
+void ReleaseArena(Arena &arena);
+
+/// @brief Makes the current task skip its arena while alive, for the kernel
+/// objects that must outlive the program
+struct ArenaSuspend
+{
+    ArenaSuspend();
+    ArenaSuspend(ArenaSuspend &) = delete;
+    ArenaSuspend(ArenaSuspend &&) = delete;
+    ~ArenaSuspend();
+
+    Arena *arena;
+};
 }
 
 #endif
@@ -0,0 +1,152 @@
+#include "apic.hxx"
+#include "clock.hxx"
+#include "clockevent.hxx"
+#include "timer.hxx"
+#include "tty.hxx"
+#include "vendor.hxx"
+
+#define APIC_BASE_MSR 0x1B
+#define APIC_BASE_BSP (1 << 8)
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_ID 0x020
+#define LAPIC_VERSION 0x030
+#define LAPIC_TPR 0x080
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LVT_MASKED (1 << 16)
+#define LVT_NMI (4 << 8)
+#define LVT_EXTINT (7 << 8)
+#define SVR_ENABLE (1 << 8)
+
+static volatile uint32_t *apicBase = nullptr;
+static uint32_t timerKHz = 0; // Timer counts per millisecond
+
+static inline uint64_t apic_rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile("rdmsr"
+                 : "=a"(lo), "=d"(hi)
+                 : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void apic_wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/// @brief Enable the local APIC of the running processor, the PIC stays
+/// wired to the boot processor through LINT0
+/// @return false if the processor has none
+bool APIC::Init()
+{
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    asm volatile("cpuid"
+                 : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 9)))
+    {
+        TTY::Print("apic: Not present\n");
+        return false;
+    }
+
+    uint64_t msr = apic_rdmsr(APIC_BASE_MSR);
+    apic_wrmsr(APIC_BASE_MSR, msr | APIC_BASE_ENABLE);
+    apicBase = reinterpret_cast<volatile uint32_t *>((uintptr_t)(msr & 0xFFFFF000));
+
+    // Only the boot processor gets the interrupts of the PIC
+    bool boot = msr & APIC_BASE_BSP;
+    APIC::Write(LAPIC_TPR, 0);
+    APIC::Write(LAPIC_LVT_LINT0, boot ? LVT_EXTINT : LVT_MASKED);
+    APIC::Write(LAPIC_LVT_LINT1, boot ? LVT_NMI : LVT_MASKED);
+    APIC::Write(LAPIC_LVT_ERROR, LVT_MASKED);
+    APIC::Write(LAPIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+    APIC::Write(LAPIC_SVR, SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+    // The other processors can't print yet, they have no task to block with
+    if (boot)
+        TTY::Print("apic: Local APIC %u at %p, version %x\n", APIC::Read(LAPIC_ID) >> 24,
+                   apicBase, APIC::Read(LAPIC_VERSION) & 0xFF);
+    return true;
+}
+
+bool APIC::IsEnabled()
+{
+    return apicBase != nullptr;
+}
+
+uint32_t APIC::Read(unsigned reg)
+{
+    return apicBase[reg / sizeof(uint32_t)];
+}
+
+void APIC::Write(unsigned reg, uint32_t value)
+{
+    apicBase[reg / sizeof(uint32_t)] = value;
+}
+
+void APIC::EOI()
+{
+    APIC::Write(LAPIC_EOI, 0);
+}
+
+/// @brief Measure the rate of the timer against the clock, the timer counts
+/// at the rate of the bus so it has to be measured
+/// @return false if there's no local APIC
+bool APIC::InitTimer()
+{
+    if (!APIC::IsEnabled())
+        return false;
+
+    static_assert(APIC_TIMER_DIVIDER == 16);
+    APIC::Write(LAPIC_TIMER_DIVIDE, 0x03);
+    APIC::Write(LAPIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+    APIC::Write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    Clock::Delay(CLOCK_CALIBRATE_MS * 1000000);
+    uint32_t counts = 0xFFFFFFFF - APIC::Read(LAPIC_TIMER_CURRENT);
+    APIC::Write(LAPIC_TIMER_INITIAL, 0);
+
+    timerKHz = counts / CLOCK_CALIBRATE_MS;
+    if (timerKHz == 0)
+        return false;
+    // One-shot from now on, it stays stopped until it's armed
+    APIC::Write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+    TTY::Print("apic: Timer at %u kHz\n", timerKHz);
+    return true;
+}
+
+/// @brief Raise the timer interrupt once, ns from now
+void APIC::ArmTimer(uint32_t ns)
+{
+    uint64_t counts = UDiv64((uint64_t)ns * timerKHz, 1000000);
+    APIC::Write(LAPIC_TIMER_INITIAL, counts == 0 ? 1 : (counts >> 32 ? 0xFFFFFFFF : counts));
+}
+
+/// @brief Farthest the timer can be armed
+uint32_t APIC::GetTimerMaxNs()
+{
+    uint64_t ns = UDiv64(0xFFFFFFFFull * 1000000, timerKHz);
+    return ns >> 32 ? 0xFFFFFFFF : ns;
+}
+
+extern "C" void IntF8h_Handler()
+{
+    ClockEvent::Interrupt();
+    APIC::EOI();
+    Timer::Run();
+}
+
+/* Spurious interrupts aren't acknowledged */
+extern "C" void IntFFh_Handler()
+{
+
+}
@@ -0,0 +1,29 @@
+#ifndef APIC_HXX
+#define APIC_HXX 1
+
+#include <cstdint>
+
+#define APIC_TIMER_VECTOR (0xF8)
+#define APIC_SPURIOUS_VECTOR (0xFF)
+#define APIC_TIMER_DIVIDER (16)
+
+/// @brief Local APIC of the processor
+/// The interrupts of the PIC keep coming through LINT0, the local APIC is
+/// used for its timer and for the interrupts between processors
+namespace APIC
+{
+bool Init();
+bool IsEnabled();
+uint32_t Read(unsigned reg);
+void Write(unsigned reg, uint32_t value);
+void EOI();
+
+bool InitTimer();
+void ArmTimer(uint32_t ns);
+uint32_t GetTimerMaxNs();
+}
+
+extern "C" void IntF8h_Handler();
+extern "C" void IntFFh_Handler();
+
+#endif
@@ -4,6 +4,7 @@
 #include "vendor.hxx"
 #include "tty.hxx"
 #include "task.hxx"
+#include "pit.hxx"
 
 // The necessary I/O ports, indexed by "bus"
 #define ATA_DATA(x) (x)
@@ -89,7 +90,7 @@ bool ATAPI::Device::IsPresent()
     return true;
 }
 
-static bool dataReady[2] = {false, false};
+static Task::Event dataReady[2] = {Task::Event(true), Task::Event(true)};
 
 /// @brief Sends a command to the ATAPI device
 /// @param cmd Command buffer chain to send
@@ -127,21 +128,22 @@ bool ATAPI::Device::SendCommand(uint8_t *cmd, size_t size)
     if (status & 0x1)
         return false;
 
+    // Forget the IRQ sent after the data of the last command
+    auto& isReady = dataReady[this->bus == ATAPI::Device::Bus::PRIMARY ? 0 : 1];
+    isReady.Reset();
+
     TTY::Print("atapi: Sending command %x (%u words)\n", cmd[0], size / 2);
     // Send ATAPI/SCSI command
     for (size_t i = 0; i < size / sizeof(uint16_t); i++)
         IO_Out16(this->bus, ((uint16_t *)cmd)[i]);
 
     // Wait for IRQ that says the data is ready
-    auto& isReady = dataReady[this->bus == ATAPI::Device::Bus::PRIMARY ? 0 : 1];
     TTY::Print("atapi: Wait for IRQ\n");
-    if (!IO_TimeoutWait(30 * 1000, [this, &isReady]() -> bool
-{ return isReady; }))
+    if (!isReady.Wait(PIT::MsToTicks(2000)))
     {
         TTY::Print("atapi: IRQ never arrived\n");
         return false;
     }
-    isReady = false;
     TTY::Print("atapi: Command sent succesfully\n");
 
     asm("cli");
@@ -213,18 +215,18 @@ int ATAPI::Device::Read(uint32_t lba, uint8_t *buffer, size_t size)
 
 extern "C" void IntF6h_Handler()
 {
-    Task::DisableSwitch();
+#ifdef DEBUG
     TTY::Print("atapi: Handling F6\n");
-    dataReady[0] = true;
+#endif
+    dataReady[0].Set();
     PIC::Get().EOI(14);
-    Task::EnableSwitch();
 }
 
 extern "C" void IntF7h_Handler()
 {
-    Task::DisableSwitch();
+#ifdef DEBUG
     TTY::Print("atapi: Handling F7\n");
-    dataReady[1] = true;
+#endif
+    dataReady[1].Set();
     PIC::Get().EOI(15);
-    Task::EnableSwitch();
 }
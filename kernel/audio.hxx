@@ -5,6 +5,7 @@
 #include <vector>
 #include <algorithm>
 #include "vendor.hxx"
+#include "alloc.hxx"
 
 #define MAX_HZ 48000
 
@@ -46,6 +47,7 @@ public:
     /// @brief Add driver to global system
     static void AddSystem(Driver& p)
     {
+        HimemAlloc::ArenaSuspend noArena;
         drivers.push_back(&p);
     }
 
@@ -0,0 +1,101 @@
+#include "clock.hxx"
+#include "pit.hxx"
+#include "task.hxx"
+#include "sync.hxx"
+#include "tty.hxx"
+#include "vendor.hxx"
+
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61 // Gate and output of channel 2, shared with the speaker
+
+static bool isCalibrated = false;
+static uint64_t tscBase = 0;
+// Nanoseconds per cycle, fixed point with clockShift fractional bits
+static uint32_t clockMult = 0;
+static unsigned clockShift = 32;
+static uint32_t tscKHz = 0;
+
+static inline uint64_t clock_tsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc"
+                 : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Cycles taken by channel 2 to count CLOCK_CALIBRATE_MS down */
+static uint32_t clock_measure()
+{
+    uint32_t count = PIT_BASE_HZ / (1000 / CLOCK_CALIBRATE_MS);
+    auto flags = Sync::SaveIRQ();
+    // Gate on, speaker off
+    IO_Out8(PIT_GATE, (IO_In8(PIT_GATE) & ~0x02) | 0x01);
+    IO_Out8(PIT_COMMAND, 0xB0); // Channel 2, low then high byte, one-shot
+    IO_Out8(PIT_CHANNEL2, count & 0xFF);
+    IO_Out8(PIT_CHANNEL2, (count >> 8) & 0xFF);
+
+    uint64_t start = clock_tsc();
+    while (!(IO_In8(PIT_GATE) & 0x20)) // Output goes high at terminal count
+        ;
+    uint64_t end = clock_tsc();
+    Sync::RestoreIRQ(flags);
+    return end - start;
+}
+
+/// @brief Calibrate the TSC, the clock starts at 0 here
+void Clock::Init()
+{
+    // Anything getting in the way only makes a run longer
+    uint32_t cycles = ~0u;
+    for (size_t i = 0; i < CLOCK_CALIBRATE_RUNS; i++)
+    {
+        uint32_t run = clock_measure();
+        if (run < cycles)
+            cycles = run;
+    }
+    tscKHz = cycles / CLOCK_CALIBRATE_MS;
+
+    // The multiplier has to fit 32 bits, slow clocks lose fractional bits
+    uint64_t ns = (uint64_t)CLOCK_CALIBRATE_MS * 1000000;
+    clockShift = 32;
+    while (clockShift > 0 && UDiv64(ns << clockShift, cycles) >> 32)
+        clockShift--;
+    clockMult = UDiv64(ns << clockShift, cycles);
+    tscBase = clock_tsc();
+    isCalibrated = true;
+    TTY::Print("clock: TSC at %u kHz\n", tscKHz);
+}
+
+/// @brief Obtain the nanoseconds since Init
+uint64_t Clock::Now()
+{
+    if (!isCalibrated)
+        return (uint64_t)Task::GetTicks() * (1000000000 / PIT::GetRate());
+
+    // (cycles * mult) >> shift without a 96-bit product
+    uint64_t cycles = clock_tsc() - tscBase;
+    uint32_t hi = cycles >> 32, lo = cycles;
+    return (((uint64_t)hi * clockMult) << (32 - clockShift))
+        + (((uint64_t)lo * clockMult) >> clockShift);
+}
+
+/// @brief Obtain the frequency of the TSC in kHz, 0 before Init
+uint32_t Clock::GetFrequency()
+{
+    return tscKHz;
+}
+
+/// @brief Convert nanoseconds to milliseconds
+uint32_t Clock::ToMs(uint64_t ns)
+{
+    return UDiv64(ns, 1000000);
+}
+
+/// @brief Spin for ns nanoseconds
+void Clock::Delay(uint64_t ns)
+{
+    uint64_t until = Clock::Now() + ns;
+    while (Clock::Now() < until)
+        asm volatile("pause");
+}
@@ -0,0 +1,21 @@
+#ifndef CLOCK_HXX
+#define CLOCK_HXX 1
+
+#include <cstdint>
+
+/// @brief Monotonic clock
+/// Reads the TSC, calibrated at boot against channel 2 of the PIT. Before
+/// Init it counts the ticks of the PIT instead.
+namespace Clock
+{
+#define CLOCK_CALIBRATE_MS 10 // Length of a calibration run
+#define CLOCK_CALIBRATE_RUNS 3
+
+void Init();
+uint64_t Now();
+uint32_t GetFrequency();
+uint32_t ToMs(uint64_t ns);
+void Delay(uint64_t ns);
+}
+
+#endif
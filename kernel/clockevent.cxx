@@ -0,0 +1,123 @@
+#include "clockevent.hxx"
+#include "clock.hxx"
+#include "apic.hxx"
+#include "hpet.hxx"
+#include "pit.hxx"
+#include "pic.hxx"
+#include "task.hxx"
+#include "timer.hxx"
+#include "sync.hxx"
+#include "tty.hxx"
+
+// Until Init the PIT ticks periodically and there's no device
+static ClockEvent::Device device;
+static uint32_t tickNs = 0;
+static uint64_t tickDue = 0; // Time of the next tick on the clock
+static bool isIdle = false;
+
+/* Count the ticks that went by */
+static void clockevent_catch_up(uint64_t now)
+{
+    while (now >= tickDue)
+    {
+        Task::Tick();
+        tickDue += tickNs;
+    }
+}
+
+/* Program the next tick, or the tick of the next alarm when idle */
+static void clockevent_program(uint64_t now)
+{
+    uint64_t deadline = tickDue;
+    if (isIdle)
+    {
+        unsigned limit = device.max_ns / tickNs;
+        deadline += (uint64_t)(Timer::NextExpiry(limit != 0 ? limit : 1) - 1) * tickNs;
+    }
+
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    if (delta < CLOCKEVENT_MIN_NS)
+        delta = CLOCKEVENT_MIN_NS;
+    else if (delta > device.max_ns)
+        delta = device.max_ns;
+    device.arm(delta);
+}
+
+/// @brief Take the tick over from the periodic PIT, the clock has to be
+/// calibrated and the interrupts disabled
+void ClockEvent::Init()
+{
+    tickNs = 1000000000 / PIT::GetRate();
+    if (APIC::Init() && APIC::InitTimer())
+    {
+        device = {"lapic", &APIC::ArmTimer, APIC::GetTimerMaxNs()};
+        PIC::Get().SetIRQMask(0, true);
+    }
+    else if (HPET::Init())
+        device = {"hpet", &HPET::Arm, HPET::GetMaxNs()};
+    else
+        device = {"pit", &PIT::Arm, PIT::GetMaxNs()};
+
+    auto flags = Sync::SaveIRQ();
+    uint64_t now = Clock::Now();
+    tickDue = now + tickNs;
+    clockevent_program(now);
+    Sync::RestoreIRQ(flags);
+    TTY::Print("clockevent: Ticking on the %s, up to %u us without a tick\n",
+               device.name, device.max_ns / 1000);
+}
+
+/// @brief Account for the ticks that went by and program the next event,
+/// called by the interrupt of the device before its EOI
+void ClockEvent::Interrupt()
+{
+    if (device.arm == nullptr)
+    {
+        Task::Tick();
+        return;
+    }
+
+    uint64_t now = Clock::Now();
+    clockevent_catch_up(now);
+    clockevent_program(now);
+}
+
+/// @brief Stop ticking until the next alarm, called by the idle task with the
+/// interrupts disabled right before halting
+void ClockEvent::EnterIdle()
+{
+    if (device.arm == nullptr)
+        return;
+
+    __atomic_store_n(&isIdle, true, __ATOMIC_RELEASE);
+    clockevent_program(Clock::Now());
+}
+
+/// @brief Tick again, called by the idle task once an interrupt woke it up.
+/// The alarms of the ticks that were skipped run here
+void ClockEvent::ExitIdle()
+{
+    if (device.arm == nullptr)
+        return;
+
+    auto flags = Sync::SaveIRQ();
+    isIdle = false;
+    uint64_t now = Clock::Now();
+    clockevent_catch_up(now);
+    clockevent_program(now);
+    Timer::Run();
+    Sync::RestoreIRQ(flags);
+}
+
+/// @brief Whether the tick is stopped until the next alarm, an alarm armed
+/// from another processor has to wake the boot processor up
+bool ClockEvent::IsIdle()
+{
+    return __atomic_load_n(&isIdle, __ATOMIC_ACQUIRE);
+}
+
+/// @brief Obtain the name of the device, nullptr before Init
+const char *ClockEvent::GetName()
+{
+    return device.name;
+}
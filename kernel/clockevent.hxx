@@ -0,0 +1,31 @@
+#ifndef CLOCKEVENT_HXX
+#define CLOCKEVENT_HXX 1
+
+#include <cstdint>
+
+#define CLOCKEVENT_MIN_NS (10000) // Nearest an event is programmed
+
+/// @brief Clock events
+/// The tick is kept by programming the best timer there is as a one-shot for
+/// the next tick, the local APIC timer or else the HPET or else the PIT.
+/// While the processor is idle the ticks no alarm is waiting on are skipped,
+/// the event is programmed for the next alarm and the missed ticks are
+/// accounted for when it wakes up
+namespace ClockEvent
+{
+struct Device
+{
+    const char *name = nullptr;
+    void (*arm)(uint32_t ns) = nullptr; // Raise an event once, ns from now
+    uint32_t max_ns = 0; // Farthest it can be armed
+};
+
+void Init();
+void Interrupt();
+void EnterIdle();
+void ExitIdle();
+bool IsIdle();
+const char *GetName();
+}
+
+#endif
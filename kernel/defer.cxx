@@ -0,0 +1,132 @@
+#include "defer.hxx"
+#include "clock.hxx"
+#include "smp.hxx"
+#include "sync.hxx"
+#include "task.hxx"
+#include "vendor.hxx"
+
+struct DeferIRQ
+{
+    uint32_t count = 0;
+    uint32_t max_ns = 0;
+    uint64_t total_ns = 0;
+};
+
+struct DeferCPU
+{
+    Sync::Spinlock lock;
+    Defer::Work *head = nullptr;
+    Defer::Work *tail = nullptr;
+    DeferIRQ irqs[DEFER_IRQ_COUNT];
+};
+
+static DeferCPU cpus[SMP_MAX_CPUS];
+// Set whenever work is queued, the task draining the queues waits on it
+static Task::Event ready(true);
+
+static void defer_main()
+{
+    while (1)
+    {
+        ready.Wait();
+        for (unsigned i = 0; i < SMP::GetCount(); i++)
+        {
+            auto &cpu = cpus[i];
+            cpu.lock.Lock();
+            auto *list = cpu.head;
+            cpu.head = cpu.tail = nullptr;
+            cpu.lock.Unlock();
+
+            // Each one can be queued again as soon as it's taken off
+            while (list != nullptr)
+            {
+                auto &work = *list;
+                cpu.lock.Lock();
+                list = work.next;
+                work.next = nullptr;
+                work.is_queued = false;
+                cpu.lock.Unlock();
+                work.fn(work.data);
+            }
+        }
+    }
+}
+
+/// @brief Start the task running the work, the work queued before runs once
+/// it starts
+void Defer::Init()
+{
+    auto &task = Task::Add(&defer_main, nullptr, false);
+    task.name = "defer";
+    Task::SetPriority(task, PRIORITY_HIGH);
+}
+
+/// @brief Queue work to run on the task, can be called from the interrupt
+/// handlers
+/// @return false if it was already queued
+bool Defer::Queue(Defer::Work &work)
+{
+    auto &cpu = cpus[SMP::GetId()];
+    cpu.lock.Lock();
+    bool queued = !work.is_queued;
+    if (queued)
+    {
+        work.is_queued = true;
+        work.next = nullptr;
+        if (cpu.tail != nullptr)
+            cpu.tail->next = &work;
+        else
+            cpu.head = &work;
+        cpu.tail = &work;
+    }
+    cpu.lock.Unlock();
+    if (queued)
+        ready.Set();
+    return queued;
+}
+
+/// @brief Obtain the time spent in the handler of a vector since boot, on
+/// all the processors
+Defer::IRQStats Defer::GetIRQStats(unsigned vector)
+{
+    Defer::IRQStats stats{};
+    if (vector < DEFER_IRQ_BASE || vector >= DEFER_IRQ_BASE + DEFER_IRQ_COUNT)
+        return stats;
+
+    uint64_t total = 0;
+    auto flags = Sync::SaveIRQ();
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+    {
+        auto &irq = cpus[i].irqs[vector - DEFER_IRQ_BASE];
+        stats.count += irq.count;
+        total += irq.total_ns;
+        if (irq.max_ns > stats.max_ns)
+            stats.max_ns = irq.max_ns;
+    }
+    Sync::RestoreIRQ(flags);
+    if (stats.count != 0)
+        stats.avg_ns = UDiv64(total, stats.count);
+    return stats;
+}
+
+/* Called by the stubs of the interrupts with the handler to run, the ones of
+ * the IRQs get timed */
+extern "C" void Kernel_IRQDispatch(uint32_t vector, void (*handler)())
+{
+    if (vector < DEFER_IRQ_BASE)
+    {
+        handler();
+        return;
+    }
+
+    uint64_t start = Clock::Now();
+    handler();
+    uint64_t time = Clock::Now() - start;
+    uint32_t ns = time >> 32 != 0 ? ~0u : (uint32_t)time;
+
+    auto &irq = cpus[SMP::GetId()].irqs[vector - DEFER_IRQ_BASE];
+    irq.count++;
+    irq.total_ns += ns;
+    if (ns > irq.max_ns)
+        irq.max_ns = ns;
+}
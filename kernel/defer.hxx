@@ -0,0 +1,51 @@
+#ifndef DEFER_HXX
+#define DEFER_HXX 1
+
+#include <cstdint>
+
+/// @brief Deferred work
+/// Interrupt handlers only acknowledge the device and queue the rest of the
+/// work, which is run by a kernel task of a high priority. Each processor
+/// queues on its own list. The time the handlers of the IRQs take is kept
+/// for each of them.
+namespace Defer
+{
+#define DEFER_IRQ_BASE (0xE8) // First vector the handler times are kept for
+#define DEFER_IRQ_COUNT (0x100 - DEFER_IRQ_BASE)
+
+/// @brief Work queued by an interrupt handler, queueing it again before it
+/// runs does nothing. It must stay alive while it's queued
+struct Work
+{
+    Work() = default;
+    Work(void (*_fn)(void *), void *_data)
+        : fn{_fn},
+          data{_data}
+    {
+
+    }
+    Work(Work &) = delete;
+    Work(Work &&) = delete;
+    Work &operator=(const Work &) = delete;
+
+    void (*fn)(void *) = nullptr;
+    void *data = nullptr;
+    bool is_queued = false;
+    Defer::Work *next = nullptr;
+};
+
+/// @brief Time spent in the handler of a vector, with the interrupts off
+/// except for the timer alarms run on the way out
+struct IRQStats
+{
+    uint32_t count;
+    uint32_t max_ns;
+    uint32_t avg_ns;
+};
+
+void Init();
+bool Queue(Defer::Work &work);
+Defer::IRQStats GetIRQStats(unsigned vector);
+}
+
+#endif
@@ -4,6 +4,9 @@
 #include <cstdint>
 #include <cstring>
 #include "assert.hxx"
+#include "pool.hxx"
+
+#define DRM_BLOWFISH_GRAIN (64) // Blocks decrypted by a job at least
 
 namespace DRM::Blowfish {
 /// @brief Feistel function for the blowfish cryptograpghic algorithm
@@ -310,6 +313,17 @@ void Decrypt(void *_out, const uint32_t parray[32], const uint32_t sbox[4][256],
     }
 }
 
+/// @brief Decrypt like Decrypt with the blocks spread over the worker pool,
+/// they're all independent of each other
+void DecryptParallel(void *_out, const uint32_t parray[32], const uint32_t sbox[4][256], const void *_data, size_t len)
+{
+    assert(len % sizeof(uint64_t) == 0);
+    Pool::ParallelFor(0, len / sizeof(uint64_t), DRM_BLOWFISH_GRAIN, [&](size_t from, size_t to) -> void {
+        size_t at = from * sizeof(uint64_t);
+        Decrypt(static_cast<uint8_t *>(_out) + at, parray, sbox, static_cast<const uint8_t *>(_data) + at, (to - from) * sizeof(uint64_t));
+    });
+}
+
 bool IsValidSerialKey(const char& key)
 {
     if(!std::strlen(&key))
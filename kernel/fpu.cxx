@@ -0,0 +1,175 @@
+#include "fpu.hxx"
+#include "task.hxx"
+#include "alloc.hxx"
+#include "smp.hxx"
+#include "sync.hxx"
+#include "tty.hxx"
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define CPUID_FPU (1 << 0)
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE (1 << 25)
+
+static bool hasFPU = false;
+static bool hasFXSR = false;
+static bool hasSSE = false;
+// Task whose state is on the unit of each processor, the unit is free to
+// use without trapping while it runs
+static Task::TSS *owners[SMP_MAX_CPUS];
+
+static inline uint32_t fpu_read_cr0()
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0,%0"
+                 : "=r"(cr0));
+    return cr0;
+}
+
+static inline void fpu_write_cr0(uint32_t cr0)
+{
+    asm volatile("mov %0,%%cr0"
+                 :
+                 : "r"(cr0)
+                 : "memory");
+}
+
+/// @brief Set up the unit of the running processor, called by each of them.
+/// The first call looks for what the processor has
+void FPU::Init()
+{
+    static bool isProbed = false;
+    if (!isProbed)
+    {
+        uint32_t eax = 1, ebx, ecx = 0, edx;
+        asm volatile("cpuid"
+                     : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        hasFPU = (edx & CPUID_FPU) != 0;
+        hasFXSR = (edx & CPUID_FXSR) != 0;
+        hasSSE = hasFXSR && (edx & CPUID_SSE) != 0;
+        isProbed = true;
+        TTY::Print("fpu: %s%s%s\n", hasFPU ? "x87" : "None",
+                   hasFXSR ? " FXSR" : "", hasSSE ? " SSE" : "");
+    }
+    if (!hasFPU)
+        return;
+
+    // Errors are reported as exceptions, not through IRQ 13
+    uint32_t cr0 = fpu_read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    fpu_write_cr0(cr0);
+    if (hasFXSR)
+    {
+        uint32_t cr4;
+        asm volatile("mov %%cr4,%0"
+                     : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if (hasSSE)
+            cr4 |= CR4_OSXMMEXCPT;
+        asm volatile("mov %0,%%cr4"
+                     :
+                     : "r"(cr4));
+    }
+    asm volatile("fninit");
+    owners[SMP::GetId()] = nullptr;
+    fpu_write_cr0(cr0 | CR0_TS);
+}
+
+/// @brief Whether the SSE instructions can be used
+bool FPU::HasSSE()
+{
+    return hasSSE;
+}
+
+/// @brief Give the unit to the running task, called on the device not
+/// available exception
+/// @return false if it wasn't caused by the lazy switch
+bool FPU::Trap()
+{
+    if (!hasFPU || !(fpu_read_cr0() & CR0_TS))
+        return false;
+
+    // A hardware task switch sets TS too, the state is still on the unit
+    auto &task = Task::GetCurrent();
+    if (owners[SMP::GetId()] == &task)
+    {
+        asm volatile("clts" ::: "memory");
+        return true;
+    }
+
+    // Allocated before taking the unit, the task may sleep on the heap
+    if (task.fpu_state == nullptr)
+    {
+        task.fpu_state = HimemAlloc::AlignAlloc(HimemAlloc::Manager::GetDefault(), FPU_STATE_SIZE, FPU_STATE_ALIGN);
+        if (task.fpu_state == nullptr)
+        {
+            TTY::Print("fpu: No memory for the state of the task\n");
+            return false;
+        }
+        task.fpu_is_clean = true;
+    }
+
+    auto flags = Sync::SaveIRQ();
+    asm volatile("clts" ::: "memory");
+    if (task.fpu_is_clean)
+    {
+        asm volatile("fninit");
+        if (hasSSE)
+        {
+            uint32_t mxcsr = FPU_DEFAULT_MXCSR;
+            asm volatile("ldmxcsr %0"
+                         :
+                         : "m"(mxcsr));
+        }
+        task.fpu_is_clean = false;
+    }
+    else if (hasFXSR)
+        asm volatile("fxrstor (%0)"
+                     :
+                     : "r"(task.fpu_state)
+                     : "memory");
+    else
+        asm volatile("frstor (%0)"
+                     :
+                     : "r"(task.fpu_state)
+                     : "memory");
+    owners[SMP::GetId()] = &task;
+    Sync::RestoreIRQ(flags);
+    return true;
+}
+
+/// @brief Save the state of a task that's being switched out if it used the
+/// unit, it may run next on another processor
+void FPU::SwitchOut(Task::TSS &task)
+{
+    auto &owner = owners[SMP::GetId()];
+    if (owner != &task)
+        return;
+
+    if (hasFXSR)
+        asm volatile("fxsave (%0)"
+                     :
+                     : "r"(task.fpu_state)
+                     : "memory");
+    else
+        asm volatile("fnsave (%0)"
+                     :
+                     : "r"(task.fpu_state)
+                     : "memory");
+    owner = nullptr;
+    fpu_write_cr0(fpu_read_cr0() | CR0_TS);
+}
+
+/// @brief Free the save area of a task that has finished
+void FPU::Release(Task::TSS &task)
+{
+    if (task.fpu_state != nullptr)
+        HimemAlloc::Free(HimemAlloc::Manager::GetDefault(), task.fpu_state);
+    task.fpu_state = nullptr;
+}
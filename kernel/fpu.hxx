@@ -0,0 +1,29 @@
+#ifndef FPU_HXX
+#define FPU_HXX 1
+
+#include <cstdint>
+
+namespace Task
+{
+struct TSS;
+}
+
+/// @brief Floating point and SIMD state of the tasks
+/// CR0.TS is kept set so the first x87/MMX/SSE instruction a task runs after
+/// a switch traps, the state of the task is loaded then, from a save area
+/// allocated the first time it's used. A task that used the unit has its
+/// state saved when it's switched out. Interrupt handlers must not use it.
+namespace FPU
+{
+#define FPU_STATE_SIZE (512) // Taken by FXSAVE, FNSAVE only needs 108
+#define FPU_STATE_ALIGN (16)
+#define FPU_DEFAULT_MXCSR (0x1F80) // Every SIMD exception masked
+
+void Init();
+bool HasSSE();
+bool Trap();
+void SwitchOut(Task::TSS &task);
+void Release(Task::TSS &task);
+}
+
+#endif
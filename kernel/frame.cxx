@@ -0,0 +1,214 @@
+#include <cstdint>
+#include <cstddef>
+#include <bit>
+#include "frame.hxx"
+#include "tty.hxx"
+
+#define FRAME_COUNT (FRAME_MAX_ADDR / FRAME_SIZE)
+
+/* Free runs are linked through their first bytes */
+struct FreeRun
+{
+    FreeRun *next;
+    FreeRun *prev;
+};
+
+/* A bit per run of each order, set if the run is free as a whole. The order 0
+ * bitmap goes first, then the (half as big) order 1 one and so on */
+static uint32_t freeBitmap[2 * FRAME_COUNT / 32] = {};
+static FreeRun *freeLists[FrameAlloc::Zone::NUM_ZONES][FRAME_MAX_ORDER + 1] = {};
+static size_t freeRuns[FRAME_MAX_ORDER + 1] = {};
+static size_t totalBytes = 0, freeBytes = 0;
+
+static struct
+{
+    uintptr_t start;
+    uintptr_t end;
+} reserved[FRAME_MAX_RESERVED] = {};
+static size_t n_reserved = 0;
+
+static inline size_t frame_bit(uintptr_t frame, unsigned order)
+{
+    size_t offset = 2 * FRAME_COUNT - (2 * FRAME_COUNT >> order);
+    return offset + (frame >> order);
+}
+
+static inline bool frame_is_free(uintptr_t frame, unsigned order)
+{
+    size_t bit = frame_bit(frame, order);
+    return (freeBitmap[bit / 32] >> (bit % 32)) & 1;
+}
+
+static inline FrameAlloc::Zone frame_zone(uintptr_t frame)
+{
+    return frame * FRAME_SIZE < FRAME_DMA_LIMIT ? FrameAlloc::Zone::DMA : FrameAlloc::Zone::NORMAL;
+}
+
+static void frame_link(uintptr_t frame, unsigned order)
+{
+    auto *run = (FreeRun *)(frame * FRAME_SIZE);
+    auto *&head = freeLists[frame_zone(frame)][order];
+    run->prev = nullptr;
+    run->next = head;
+    if (head != nullptr)
+        head->prev = run;
+    head = run;
+
+    size_t bit = frame_bit(frame, order);
+    freeBitmap[bit / 32] |= 1u << (bit % 32);
+    freeRuns[order]++;
+    freeBytes += FRAME_SIZE << order;
+}
+
+static void frame_unlink(uintptr_t frame, unsigned order)
+{
+    auto *run = (FreeRun *)(frame * FRAME_SIZE);
+    if (run->prev != nullptr)
+        run->prev->next = run->next;
+    else
+        freeLists[frame_zone(frame)][order] = run->next;
+    if (run->next != nullptr)
+        run->next->prev = run->prev;
+
+    size_t bit = frame_bit(frame, order);
+    freeBitmap[bit / 32] &= ~(1u << (bit % 32));
+    freeRuns[order]--;
+    freeBytes -= FRAME_SIZE << order;
+}
+
+/// @brief Mark a range of memory as not usable, must be done before adding
+/// the ranges of the memory map
+void FrameAlloc::Reserve(uintptr_t start, uintptr_t end)
+{
+    if (n_reserved >= FRAME_MAX_RESERVED)
+    {
+        TTY::Print("frame: Too many reserved ranges\n");
+        return;
+    }
+    reserved[n_reserved].start = start;
+    reserved[n_reserved].end = end;
+    n_reserved++;
+}
+
+/// @brief Give a range of usable RAM to the allocator, the reserved ranges
+/// and the partial frames on the edges are left out
+void FrameAlloc::AddRange(uintptr_t start, uintptr_t end)
+{
+    if (start >= FRAME_MAX_ADDR)
+        return;
+    if (end > FRAME_MAX_ADDR)
+        end = FRAME_MAX_ADDR;
+
+    for (size_t i = 0; i < n_reserved; i++)
+    {
+        if (reserved[i].start >= end || reserved[i].end <= start)
+            continue;
+
+        if (reserved[i].start > start)
+            FrameAlloc::AddRange(start, reserved[i].start);
+        if (reserved[i].end < end)
+            FrameAlloc::AddRange(reserved[i].end, end);
+        return;
+    }
+
+    uintptr_t frame = (start + FRAME_SIZE - 1) / FRAME_SIZE;
+    uintptr_t last = end / FRAME_SIZE;
+    while (frame < last)
+    {
+        /* Biggest naturally aligned run that fits */
+        unsigned order = frame ? std::countr_zero(frame) : FRAME_MAX_ORDER;
+        if (order > FRAME_MAX_ORDER)
+            order = FRAME_MAX_ORDER;
+        while (frame + (1 << order) > last)
+            order--;
+
+        totalBytes += FRAME_SIZE << order;
+        FrameAlloc::Free((void *)(frame * FRAME_SIZE), order);
+        frame += 1 << order;
+    }
+}
+
+/// @brief Allocate a naturally aligned run of 2^order frames
+/// @param zone Normal allocations fall back to the DMA zone
+void *FrameAlloc::Alloc(unsigned order, FrameAlloc::Zone zone)
+{
+    if (order > FRAME_MAX_ORDER)
+        return nullptr;
+
+    for (int z = zone; z >= 0; z--)
+    {
+        for (unsigned k = order; k <= FRAME_MAX_ORDER; k++)
+        {
+            auto *run = freeLists[z][k];
+            if (run == nullptr)
+                continue;
+
+            uintptr_t frame = (uintptr_t)run / FRAME_SIZE;
+            frame_unlink(frame, k);
+            /* Give back the upper halves until it's of the right size */
+            while (k > order)
+            {
+                k--;
+                frame_link(frame + (1 << k), k);
+            }
+            return run;
+        }
+    }
+    return nullptr;
+}
+
+/// @brief Free a run of frames, merging it with its buddies
+void FrameAlloc::Free(void *addr, unsigned order)
+{
+    uintptr_t frame = (uintptr_t)addr / FRAME_SIZE;
+    if ((uintptr_t)addr % FRAME_SIZE || frame >= FRAME_COUNT || order > FRAME_MAX_ORDER
+            || (frame & ((1 << order) - 1)))
+    {
+        TTY::Print("frame: Bad free of %p order %u\n", addr, order);
+        return;
+    }
+
+    if (frame_is_free(frame, order))
+    {
+        TTY::Print("frame: Double free of %p\n", addr);
+        return;
+    }
+
+    while (order < FRAME_MAX_ORDER)
+    {
+        uintptr_t buddy = frame ^ (1 << order);
+        if (!frame_is_free(buddy, order))
+            break;
+        frame_unlink(buddy, order);
+        frame &= ~(uintptr_t)(1 << order);
+        order++;
+    }
+    frame_link(frame, order);
+}
+
+/// @brief Obtain the smallest order that holds size bytes, greater than
+/// FRAME_MAX_ORDER if there's none
+unsigned FrameAlloc::GetOrder(size_t size)
+{
+    if (size <= FRAME_SIZE)
+        return 0;
+    return std::bit_width((size - 1) / FRAME_SIZE);
+}
+
+FrameAlloc::Info FrameAlloc::GetInfo()
+{
+    FrameAlloc::Info info{};
+    info.total = totalBytes;
+    info.free = freeBytes;
+    for (size_t i = 0; i <= FRAME_MAX_ORDER; i++)
+        info.free_runs[i] = freeRuns[i];
+    return info;
+}
+
+void FrameAlloc::Print()
+{
+    TTY::Print("frame: %u KiB free of %u KiB\n", freeBytes / 1024, totalBytes / 1024);
+    for (size_t i = 0; i <= FRAME_MAX_ORDER; i++)
+        if (freeRuns[i])
+            TTY::Print("Order %u (%u KiB): %u free\n", i, (FRAME_SIZE << i) / 1024, freeRuns[i]);
+}
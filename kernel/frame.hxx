@@ -0,0 +1,47 @@
+#ifndef FRAME_HXX
+#define FRAME_HXX 1
+
+#include <cstddef>
+#include <cstdint>
+
+/// @brief Physical page frame allocator
+/// Binary buddy allocator over the RAM given by the bootloader memory map,
+/// hands out naturally aligned runs of 2^order frames, from a single frame
+/// up to 4 MiB. Free runs keep their list links on themselves so the only
+/// other state is a bitmap per order.
+///
+/// Memory below 16 MiB is kept on its own zone for ISA DMA, it's only used
+/// for normal allocations when everything else has ran out.
+namespace FrameAlloc
+{
+#define FRAME_SIZE 4096
+#define FRAME_MAX_ORDER 10           // 4 MiB runs
+#define FRAME_MAX_ADDR 0x40000000    // Memory past 1 GiB isn't managed
+#define FRAME_DMA_LIMIT 0x1000000    // ISA DMA can only reach the first 16 MiB
+#define FRAME_MAX_RESERVED 8
+
+enum Zone
+{
+    DMA = 0,
+    NORMAL = 1,
+    NUM_ZONES
+};
+
+void Reserve(uintptr_t start, uintptr_t end);
+void AddRange(uintptr_t start, uintptr_t end);
+void *Alloc(unsigned order, Zone zone = Zone::NORMAL);
+void Free(void *addr, unsigned order);
+unsigned GetOrder(size_t size);
+
+struct Info
+{
+    size_t total = 0; // Bytes given with AddRange
+    size_t free = 0;
+    size_t free_runs[FRAME_MAX_ORDER + 1] = {};
+};
+
+Info GetInfo();
+void Print();
+}
+
+#endif
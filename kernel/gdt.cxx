@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <vector>
 #include <optional>
+#include "alloc.hxx"
 #include "gdt.hxx"
 #include "task.hxx"
 #include "tty.hxx"
@@ -57,6 +58,11 @@ GDT::Entry &GDT::AllocateEntry()
     __builtin_unreachable();
 }
 
+void GDT::FreeEntry(GDT::Entry &entry)
+{
+    entry = GDT::Entry{};
+}
+
 int GDT::GetEntrySegment(const GDT::Entry &entry)
 {
     return ((uintptr_t)&entry - (uintptr_t)&gdt.entries);
@@ -93,35 +99,23 @@ void GDT::SetupTSS()
 {
     // PC of the first task is overriden with current pc ;)
     auto &task = Task::Add(&Kernel_Main, &g_KernStackTop, false);
+    task.name = "kernel";
 
-    static uint8_t dummyTaskStack[1024];
-    Task::Add([]() -> void
-              {
-        while (1)
-        {
-            //TTY::Print("A");
-            Task::Switch();
-        } },
-              &dummyTaskStack[sizeof(dummyTaskStack) - 1], false);
+    // Runs whenever no other task is ready
+    Task::AddIdle();
 
     GDT::Reload();                 // Apply visable changes
     asm volatile("\tlldt %%ax\r\n" // Load our local LDT
                  :
                  : "a"(task.prot.ldtr)
                  :);
+    // The TSS of the first task stays loaded, tasks are switched in software
+    // and only ring transitions and v86 tasks use it
     asm volatile("\tltr %%ax\r\n" // Load TSS
                  :
                  : "a"(task.tss_segment)
                  :);
-    // What will happen now is:
-    // - The jump will save the EIP into the task 1
-    // - We will jump to the new kernel task (selected by the segment)
-    // - :ip in this jump is ignored
-    asm volatile("\tljmp %0,$0\r\n"
-                 :
-                 : "i"(8 * 6)
-                 :);
-    // We will call directly the Kernel_Main
+    // We are the first task now, go into Kernel_Main
     asm volatile("\tmov %1,%%eax\r\n"
                  "\tmov %0,%%esp\r\n"
                  "\tjmp *%%eax\r\n"
@@ -148,7 +142,7 @@ static struct
             .offset = (uintptr_t)&entries[0]};
 } idt;
 
-static std::optional<std::vector<void (*)(void)>> handlers[255];
+static std::optional<std::vector<void (*)(void)>> handlers[256];
 
 #define INT_STUB(x)                                  \
     extern "C" void Int##x##h_AsmStub();             \
@@ -210,8 +204,13 @@ struct V86_IntContext
 };
 
 #include "ui.hxx"
+#include "fpu.hxx"
 extern "C" void IntException_Handler(uint32_t irq, V86_IntContext &ctx)
 {
+    // The FPU is handed to the tasks lazily
+    if (irq == 0x07 && FPU::Trap())
+        return;
+
     static const char *errorNames[32] =
         {
             "Divide-by-zero Error",           // 0x00
@@ -499,19 +498,26 @@ extern "C" void IntF6h_Handler();
 // INT_STUB(F7); -- Implemented by atapi.cxx
 extern "C" void IntF7h_AsmStub();
 extern "C" void IntF7h_Handler();
-INT_STUB(F8);
-INT_STUB(F9);
+// INT_STUB(F8); -- Implemented by apic.cxx
+extern "C" void IntF8h_AsmStub();
+extern "C" void IntF8h_Handler();
+// INT_STUB(F9); -- Implemented by smp.cxx
+extern "C" void IntF9h_AsmStub();
+extern "C" void IntF9h_Handler();
 INT_STUB(FA);
 INT_STUB(FB);
 INT_STUB(FC);
 INT_STUB(FD);
 INT_STUB(FE);
-INT_STUB(FF);
+// INT_STUB(FF); -- Implemented by apic.cxx
+extern "C" void IntFFh_AsmStub();
+extern "C" void IntFFh_Handler();
 
 #define SET_ASM_STUB(x) IDT::SetEntry(0x##x, &Int##x##h_AsmStub);
 
 void IDT::AddHandler(int n, void (*fn)(void))
 {
+    HimemAlloc::ArenaSuspend noArena;
     handlers[n]->push_back(fn);
 }
 
@@ -571,7 +577,7 @@ void IDT::Init()
     SET_ASM_STUB(1F);
 
     // IRQs of devices or syscalls, all present w/ stubs
-    for (unsigned int i = 0x20; i < 0xFF; i++)
+    for (unsigned int i = 0x20; i <= 0xFF; i++)
     {
         idt.entries[i].flags.gate_type = IDT_Entry::GATE_32INT;
         idt.entries[i].seg_sel = GDT::KERNEL_XCODE;
@@ -707,14 +713,14 @@ void IDT::Init()
     SET_ASM_STUB(F5); // FPU coprocessor
     SET_ASM_STUB(F6); // Primary ATA disk
     SET_ASM_STUB(F7); // Secondary ATA disk
-    SET_ASM_STUB(F8);
-    SET_ASM_STUB(F9);
+    SET_ASM_STUB(F8); // Local APIC timer
+    SET_ASM_STUB(F9); // Processor kick
     SET_ASM_STUB(FA);
     SET_ASM_STUB(FB);
     SET_ASM_STUB(FC);
     SET_ASM_STUB(FD);
     SET_ASM_STUB(FE);
-    SET_ASM_STUB(FF);
+    SET_ASM_STUB(FF); // Local APIC spurious
 
     // Task switch interrupt, $0x84 doesn't seem to be used by any
     // DOS program so this should be fine-ish
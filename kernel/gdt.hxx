@@ -97,6 +97,7 @@ struct Entry
 } PACKED ALIGN(8);
 void Init();
 GDT::Entry &AllocateEntry();
+void FreeEntry(GDT::Entry &entry);
 int GetEntrySegment(const GDT::Entry &entry);
 void SetupTSS();
 GDT::Entry &GetEntry(unsigned segment);
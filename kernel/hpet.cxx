@@ -0,0 +1,106 @@
+#include "hpet.hxx"
+#include "acpi.hxx"
+#include "tty.hxx"
+#include "vendor.hxx"
+
+#define HPET_CAPABILITIES 0x000
+#define HPET_PERIOD 0x004 // High half of the capabilities
+#define HPET_CONFIG 0x010
+#define HPET_COUNTER 0x0F0 // Only the low half is used
+#define HPET_TIMER0_CONFIG 0x100
+#define HPET_TIMER0_COMPARATOR 0x108
+
+#define HPET_CAP_LEGACY (1 << 15)
+#define HPET_CFG_ENABLE (1 << 0)
+#define HPET_CFG_LEGACY (1 << 1)
+#define HPET_TN_INT_ENABLE (1 << 2)
+#define HPET_TN_PERIODIC (1 << 3)
+#define HPET_TN_32BIT (1 << 8)
+
+#define HPET_MAX_PERIOD 100000000 // In femtoseconds, as given by the spec
+#define HPET_MIN_COUNTS 16 // Least a comparator is set ahead of the counter
+
+struct HPET_Table
+{
+    ACPI::Header header;
+    uint32_t block_id;
+    uint8_t space_id; // Generic address of the registers
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+    uint8_t number;
+    uint16_t min_tick;
+    uint8_t protection;
+} PACKED;
+
+static volatile uint32_t *hpetBase = nullptr;
+static uint32_t hpetPeriod = 0; // Femtoseconds per count
+
+static inline uint32_t hpet_read(unsigned reg)
+{
+    return hpetBase[reg / sizeof(uint32_t)];
+}
+
+static inline void hpet_write(unsigned reg, uint32_t value)
+{
+    hpetBase[reg / sizeof(uint32_t)] = value;
+}
+
+/// @brief Find the HPET on the ACPI tables and route its first comparator
+/// to IRQ 0, the PIT stops reaching the PIC
+/// @return false if there's none or it can't replace the PIT
+bool HPET::Init()
+{
+    auto *table = reinterpret_cast<const HPET_Table *>(ACPI::FindTable("HPET"));
+    if (table == nullptr || table->space_id != 0 || table->address >> 32)
+    {
+        TTY::Print("hpet: Not present\n");
+        return false;
+    }
+
+    hpetBase = reinterpret_cast<volatile uint32_t *>((uintptr_t)table->address);
+    hpetPeriod = hpet_read(HPET_PERIOD);
+    if (hpetPeriod == 0 || hpetPeriod > HPET_MAX_PERIOD
+        || !(hpet_read(HPET_CAPABILITIES) & HPET_CAP_LEGACY))
+    {
+        TTY::Print("hpet: Unusable, period %u fs\n", hpetPeriod);
+        hpetBase = nullptr;
+        return false;
+    }
+
+    hpet_write(HPET_CONFIG, 0);
+    hpet_write(HPET_TIMER0_CONFIG, (hpet_read(HPET_TIMER0_CONFIG) & ~HPET_TN_PERIODIC)
+        | HPET_TN_INT_ENABLE | HPET_TN_32BIT);
+    hpet_write(HPET_TIMER0_COMPARATOR, 0xFFFFFFFF);
+    hpet_write(HPET_CONFIG, HPET_CFG_ENABLE | HPET_CFG_LEGACY);
+    TTY::Print("hpet: At %p, %u fs per count\n", hpetBase, hpetPeriod);
+    return true;
+}
+
+/// @brief Raise IRQ 0 once, ns from now
+void HPET::Arm(uint32_t ns)
+{
+    uint32_t counts = UDiv64((uint64_t)ns * 1000000, hpetPeriod);
+    if (counts < HPET_MIN_COUNTS)
+        counts = HPET_MIN_COUNTS;
+
+    // The comparator only fires when the counter goes past it, one set
+    // behind the counter would wait for the counter to wrap around
+    uint32_t now = hpet_read(HPET_COUNTER);
+    hpet_write(HPET_TIMER0_COMPARATOR, now + counts);
+    while ((int32_t)(hpet_read(HPET_COUNTER) - (now + counts)) >= 0)
+    {
+        counts *= 2;
+        now = hpet_read(HPET_COUNTER);
+        hpet_write(HPET_TIMER0_COMPARATOR, now + counts);
+    }
+}
+
+/// @brief Farthest the comparator can be armed, half the counter so it can
+/// be told whether it went past
+uint32_t HPET::GetMaxNs()
+{
+    uint64_t ns = UDiv64((uint64_t)0x7FFFFFFF * hpetPeriod, 1000000);
+    return ns >> 32 ? 0xFFFFFFFF : ns;
+}
@@ -0,0 +1,16 @@
+#ifndef HPET_HXX
+#define HPET_HXX 1
+
+#include <cstdint>
+
+/// @brief High precision event timer
+/// Only the first comparator is used, routed to IRQ 0 in place of the PIT
+/// as there's no I/O APIC support
+namespace HPET
+{
+bool Init();
+void Arm(uint32_t ns);
+uint32_t GetMaxNs();
+}
+
+#endif
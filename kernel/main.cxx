@@ -15,8 +15,16 @@
 #include "load.hxx"
 #include "audio.hxx"
 #include "alloc.hxx"
+#include "frame.hxx"
 
 #include "pic.hxx"
+#include "pit.hxx"
+#include "clock.hxx"
+#include "clockevent.hxx"
+#include "smp.hxx"
+#include "pool.hxx"
+#include "defer.hxx"
+#include "fpu.hxx"
 #include "uart.hxx"
 #include "pci.hxx"
 #include "ps2.hxx"
@@ -99,19 +107,85 @@ struct FCB
 extern uint8_t text_start, text_end;
 extern uint8_t rodata_start, rodata_end;
 extern uint8_t data_start, data_end;
+extern uint8_t smp_text_start, smp_text_end;
+extern uint8_t dos_text_start, dos_text_end;
+
+#define APP_IMAGE_BASE 0x1000000 // Programs are loaded here
+#define APP_IMAGE_SIZE 0x800000
+#define HEAP_GROW_ORDER 6 // Grow the kernel heap 256 KiB at least
+
+/* Heap regions past the first one come from the frame allocator */
+static void *Kernel_GrowHeap(size_t &size)
+{
+    unsigned order = FrameAlloc::GetOrder(size);
+    if (order < HEAP_GROW_ORDER)
+        order = HEAP_GROW_ORDER;
+
+    void *addr = FrameAlloc::Alloc(order);
+    if (addr != nullptr)
+        size = FRAME_SIZE << order;
+    return addr;
+}
+
+static void Kernel_ReleaseHeap(void *addr, size_t size)
+{
+    FrameAlloc::Free(addr, FrameAlloc::GetOrder(size));
+}
+
+/* There's nothing to reclaim on the kernel heap past what growing does */
+static bool Kernel_HeapFailure(size_t size, size_t align)
+{
+    TTY::Print("himem: Out of memory allocating %u bytes (align %u)\n", size, align);
+    return false;
+}
 
 static bool kernelInitLock = false;
 static bool hasGraphics = false;
 extern "C" void Kernel_Init(unsigned long magic, uint8_t *addr)
 {
     if(kernelInitLock)
-        while(1)
-            Task::Switch();
+        Task::Suspend();
     kernelInitLock = true;
 
     HimemAlloc::InitManager(HimemAlloc::Manager::GetDefault());
     static uint8_t memHeap[65536 * 8];
     HimemAlloc::AddRegion(HimemAlloc::Manager::GetDefault(), (void *)memHeap, sizeof(memHeap) - 1);
+    HimemAlloc::Manager::GetDefault().failure = Kernel_HeapFailure;
+
+    /* The trampoline of the other processors and the DOS part of the kernel
+     * sit below 1M, the low memory allocator mustn't give them out */
+    Alloc::AddUsedBlock((uintptr_t)&smp_text_start, (&smp_text_end - &smp_text_start + LOW_ALLOC_SIZE - 1) / LOW_ALLOC_SIZE);
+    Alloc::AddUsedBlock((uintptr_t)&dos_text_start, (&dos_text_end - &dos_text_start + LOW_ALLOC_SIZE - 1) / LOW_ALLOC_SIZE);
+
+    /* Low memory and the kernel image (which holds memHeap) are in use, so is
+     * the boot information and where the programs get loaded */
+    FrameAlloc::Reserve(0, (uintptr_t)&data_end);
+    FrameAlloc::Reserve(APP_IMAGE_BASE, APP_IMAGE_BASE + APP_IMAGE_SIZE);
+    if (magic == MULTIBOOT2_BOOTLOADER_MAGIC)
+    {
+        FrameAlloc::Reserve((uintptr_t)addr, (uintptr_t)addr + *(multiboot_uint32_t *)addr);
+        for (auto *tag = (multiboot_tag *)(addr + 8);
+                tag->type != MULTIBOOT_TAG_TYPE_END;
+                tag = reinterpret_cast<decltype(tag)>((multiboot_uint8_t *)tag + ((tag->size + 7) & ~7)))
+        {
+            if (tag->type != MULTIBOOT_TAG_TYPE_MMAP)
+                continue;
+
+            auto *mmap = (multiboot_tag_mmap *)tag;
+            for (auto *entry = mmap->entries;
+                    (multiboot_uint8_t *)entry < (multiboot_uint8_t *)tag + tag->size;
+                    entry = (multiboot_mmap_entry *)((multiboot_uint8_t *)entry + mmap->entry_size))
+            {
+                if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || entry->addr >= FRAME_MAX_ADDR)
+                    continue;
+
+                uint64_t end = entry->addr + entry->len;
+                FrameAlloc::AddRange(entry->addr, end > FRAME_MAX_ADDR ? FRAME_MAX_ADDR : end);
+            }
+        }
+        HimemAlloc::Manager::GetDefault().grow = Kernel_GrowHeap;
+        HimemAlloc::Manager::GetDefault().release = Kernel_ReleaseHeap;
+    }
 
     /*for (auto *tag = (multiboot_tag *)(addr + 8);
             tag->type != MULTIBOOT_TAG_TYPE_END;
@@ -146,6 +220,7 @@ extern "C" void Kernel_Init(unsigned long magic, uint8_t *addr)
 
     TTY::Print("Hello world\n");
     TTY::Print("Numbers %i,%u!!!\n", 69, 420);
+    FrameAlloc::Print();
 
     if (magic != MULTIBOOT2_BOOTLOADER_MAGIC)
         return;
@@ -188,14 +263,18 @@ static bool kernelMainLock = false;
 void Kernel_Main()
 {
     if(kernelMainLock)
-        while(1)
-            Task::Switch();
+        Task::Suspend();
     kernelMainLock = true;
 
     // Sometimes kernel_main gets executed twice
-    Task::DisableSwitch();
     PIC::Get().Remap(0xE8, 0xF0);
-    Task::EnableSwitch();
+    PIT::Init(PIT_TICK_HZ);
+    Clock::Init();
+    ClockEvent::Init();
+    FPU::Init();
+    SMP::Init();
+    Pool::Init();
+    Defer::Init();
     asm("sti"); // Always enable interrupts on the dummy task
 
     ps2Controller.emplace(); // Controllers
@@ -238,7 +317,7 @@ void Kernel_Main()
     static uint32_t serialKeySbox[4][256];
     DRM::Blowfish::GenKey(serialKeyParray, serialKeySbox, serialKey, std::strlen(serialKey));
 
-    static auto* imageBase = (void *)0x1000000;
+    static auto* imageBase = (void *)APP_IMAGE_BASE;
     static size_t offset = 0;
     while (1)
     {
@@ -246,7 +325,7 @@ void Kernel_Main()
 
         char buffer[50] = {};
         size_t n_buffer = 0;
-        for(int ch = '\0'; ch != '\n'; ch = ps2Keyboard->GetKey()) {
+        for(int ch = '\0'; ch != '\n'; ch = ps2Keyboard->WaitKey()) {
             if(ch != '\0') {
                 TTY::Print("%c", ch);
                 switch(ch) {
@@ -268,7 +347,7 @@ void Kernel_Main()
         auto r = isoCdrom->ReadFile(buffer, [](void *data, size_t len) -> bool {
             TTY::Print("Reading 0x%x bytes at %p\n", len, (uint8_t *)imageBase + offset);
             //std::memcpy((uint8_t *)imageBase + offset, data, len);
-            DRM::Blowfish::Decrypt((uint8_t *)imageBase + offset, serialKeyParray, serialKeySbox, data, len);
+            DRM::Blowfish::DecryptParallel((uint8_t *)imageBase + offset, serialKeyParray, serialKeySbox, data, len);
             offset += len;
             return true;
         });
@@ -280,7 +359,16 @@ void Kernel_Main()
         {
             TTY::Print("Executing at %p!\n", imageBase);
             const auto* info = reinterpret_cast<AppKit::ProgramInfo*>(imageBase);
+            /* Everything the program allocates goes away with it, the
+             * windows it left open are taken off the desktop first */
+            HimemAlloc::Arena appArena;
+            HimemAlloc::InitArena(appArena, HimemAlloc::Manager::GetDefault());
+            Task::GetCurrent().arena = &appArena;
             int r = info->entryPoint(nullptr);
+            Task::GetCurrent().arena = nullptr;
+            if (g_Desktop.has_value())
+                UI::Manager::Get().Detach(g_Desktop.value(), appArena);
+            HimemAlloc::ReleaseArena(appArena);
         }
         //Task::Switch();
     }
@@ -6,6 +6,7 @@
 #include <memory>
 #include <algorithm>
 #include "vendor.hxx"
+#include "alloc.hxx"
 
 #define PCI_MAX_SEGMENTS 65535
 #define PCI_MAX_BUSES 256
@@ -152,6 +153,7 @@ public:
     /// @brief Register driver with the global driver manager
     static void AddSystem(Driver& p)
     {
+        HimemAlloc::ArenaSuspend noArena;
         drivers.emplace_back(&p);
     }
 
@@ -5,6 +5,7 @@
 #include "vendor.hxx"
 #include "tty.hxx"
 #include "assert.hxx"
+#include "sync.hxx"
 
 #define PIC1 0x20 // IO base address for master PIC
 #define PIC2 0xA0 // IO base address for slave PIC
@@ -37,6 +38,8 @@ public:
 
     int master_irq_base;
     int slave_irq_base;
+    /// @brief Held through the sequences of writes to the controllers
+    Sync::Spinlock lock;
 
     PIC() = default;
     PIC(PIC&) = delete;
@@ -49,6 +52,7 @@ public:
         assert((master_off & 0x07) == 0);
         assert((slave_off & 0x07) == 0);
 
+        Sync::LockGuard<Sync::Spinlock> guard(this->lock);
         static uint8_t mask[2];
         mask[0] = IO_In8(PIC1_DATA); // Save masks
         mask[1] = IO_In8(PIC2_DATA);
@@ -81,6 +85,7 @@ public:
     void SetIRQMask(unsigned irq, bool masked)
     {
         assert(irq < 0x10); // 16-irqs only
+        Sync::LockGuard<Sync::Spinlock> guard(this->lock);
         uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
         uint8_t value = IO_In8(port);
         irq = irq >= 8 ? irq - 8 : irq;
@@ -2,12 +2,73 @@
 #include "pic.hxx"
 #include "tty.hxx"
 #include "task.hxx"
+#include "sync.hxx"
+#include "timer.hxx"
+#include "clockevent.hxx"
 
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND 0x43
+
+// The BIOS leaves the divisor at 65536
+static unsigned tickRate = PIT_BASE_HZ / 65536;
+
+/// @brief Program channel 0 to tick at the given rate
+void PIT::Init(unsigned hz)
+{
+    unsigned divisor = hz != 0 ? PIT_BASE_HZ / hz : 65536;
+    if (divisor < 2)
+        divisor = 2;
+    else if (divisor > 65536)
+        divisor = 65536;
+
+    auto flags = Sync::SaveIRQ();
+    IO_Out8(PIT_COMMAND, 0x34); // Channel 0, low then high byte, rate generator
+    IO_Out8(PIT_CHANNEL0, divisor & 0xFF);
+    IO_Out8(PIT_CHANNEL0, (divisor >> 8) & 0xFF); // 0 means 65536
+    tickRate = PIT_BASE_HZ / divisor;
+    Sync::RestoreIRQ(flags);
+    TTY::Print("pit: Ticking at %u Hz (divisor %u)\n", tickRate, divisor);
+}
+
+/// @brief Obtain the ticks per second
+unsigned PIT::GetRate()
+{
+    return tickRate;
+}
+
+/// @brief Obtain the ticks that last at least ms milliseconds
+unsigned PIT::MsToTicks(unsigned ms)
+{
+    return (ms * tickRate + 999) / 1000;
+}
+
+/// @brief Raise IRQ 0 once, ns from now
+void PIT::Arm(uint32_t ns)
+{
+    uint32_t count = UDiv64((uint64_t)ns * PIT_BASE_HZ, 1000000000);
+    if (count == 0)
+        count = 1;
+    else if (count > 0xFFFF)
+        count = 0xFFFF;
+
+    auto flags = Sync::SaveIRQ();
+    IO_Out8(PIT_COMMAND, 0x30); // Channel 0, low then high byte, one-shot
+    IO_Out8(PIT_CHANNEL0, count & 0xFF);
+    IO_Out8(PIT_CHANNEL0, (count >> 8) & 0xFF);
+    Sync::RestoreIRQ(flags);
+}
+
+/// @brief Farthest a one-shot can be armed
+uint32_t PIT::GetMaxNs()
+{
+    return UDiv64(0xFFFFull * 1000000000, PIT_BASE_HZ);
+}
+
+/* IRQ 0 comes from the PIT or from the HPET replacing it */
 extern "C" void IntE8h_Handler()
 {
-    Task::DisableSwitch();
     //TTY::Print("pit: Handling interrupt E8\n");
-    Task::Schedule();
+    ClockEvent::Interrupt();
     PIC::Get().EOI(0);
-    Task::EnableSwitch();
+    Timer::Run();
 }
@@ -1,6 +1,24 @@
 #ifndef PIT_HXX
 #define PIT_HXX 1
 
+#include <cstdint>
+
+#define PIT_BASE_HZ (1193182) // Input clock of the PIT
+#define PIT_TICK_HZ (100) // Rate of the tick given to PIT::Init at boot
+
+/// @brief Programmable interval timer
+/// Channel 0 drives the tick of the scheduler, periodically until the clock
+/// events take over and as a one-shot timer if they fall back to it. Channel
+/// 2 is only used to calibrate the TSC against
+namespace PIT
+{
+void Init(unsigned hz);
+unsigned GetRate();
+unsigned MsToTicks(unsigned ms);
+void Arm(uint32_t ns);
+uint32_t GetMaxNs();
+}
+
 extern "C" void IntE8h_Handler();
 
 #endif
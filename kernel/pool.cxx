@@ -0,0 +1,268 @@
+#include "pool.hxx"
+#include "smp.hxx"
+#include "sync.hxx"
+#include "tty.hxx"
+
+/* Chase-Lev deque, only the worker owning it pushes and pops at the bottom
+ * while anyone can steal from the top */
+struct PoolDeque
+{
+    Pool::Job *jobs[POOL_DEQUE_SIZE] = {};
+    int32_t top = 0;
+    int32_t bottom = 0;
+};
+static_assert((POOL_DEQUE_SIZE & (POOL_DEQUE_SIZE - 1)) == 0);
+
+struct PoolWorker
+{
+    Task::TSS *task = nullptr;
+    PoolDeque deque;
+};
+
+static PoolWorker workers[SMP_MAX_CPUS];
+static unsigned nWorkers = 0;
+// Jobs spawned by tasks that aren't workers
+static Sync::Spinlock queueLock;
+static Pool::Job *queue[POOL_QUEUE_SIZE];
+static unsigned queueHead = 0;
+static unsigned queueCount = 0;
+// Signalled for every job spawned, the workers sleep on it
+static Sync::Semaphore work;
+
+static bool pool_push(PoolDeque &deque, Pool::Job &job)
+{
+    int32_t bottom = __atomic_load_n(&deque.bottom, __ATOMIC_RELAXED);
+    int32_t top = __atomic_load_n(&deque.top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= POOL_DEQUE_SIZE)
+        return false;
+    deque.jobs[bottom % POOL_DEQUE_SIZE] = &job;
+    __atomic_store_n(&deque.bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Take the newest job, it races with the thieves for the last one */
+static Pool::Job *pool_pop(PoolDeque &deque)
+{
+    int32_t bottom = __atomic_load_n(&deque.bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque.bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int32_t top = __atomic_load_n(&deque.top, __ATOMIC_RELAXED);
+    if (top > bottom)
+    {
+        __atomic_store_n(&deque.bottom, bottom + 1, __ATOMIC_RELAXED);
+        return nullptr;
+    }
+
+    auto *job = deque.jobs[bottom % POOL_DEQUE_SIZE];
+    if (top == bottom)
+    {
+        if (!__atomic_compare_exchange_n(&deque.top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            job = nullptr;
+        __atomic_store_n(&deque.bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+/* Take the oldest job, nullptr if there's none or another thief got it */
+static Pool::Job *pool_steal(PoolDeque &deque)
+{
+    int32_t top = __atomic_load_n(&deque.top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int32_t bottom = __atomic_load_n(&deque.bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+        return nullptr;
+
+    auto *job = deque.jobs[top % POOL_DEQUE_SIZE];
+    if (!__atomic_compare_exchange_n(&deque.top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return nullptr;
+    return job;
+}
+
+/* Worker the running task is, nullptr if it isn't one */
+static PoolWorker *pool_worker()
+{
+    auto *task = Task::PeekCurrent();
+    for (unsigned i = 0; i < nWorkers; i++)
+        if (workers[i].task == task)
+            return &workers[i];
+    return nullptr;
+}
+
+/* Find a job to run, the own ones first, then the shared ones, then the ones
+ * of the other workers */
+static Pool::Job *pool_take(PoolWorker *worker)
+{
+    if (worker != nullptr)
+    {
+        if (auto *job = pool_pop(worker->deque))
+            return job;
+    }
+
+    Pool::Job *job = nullptr;
+    queueLock.Lock();
+    if (queueCount != 0)
+    {
+        job = queue[queueHead];
+        queueHead = (queueHead + 1) % POOL_QUEUE_SIZE;
+        queueCount--;
+    }
+    queueLock.Unlock();
+    if (job != nullptr)
+        return job;
+
+    unsigned first = worker != nullptr ? worker - workers + 1 : 0;
+    for (unsigned i = 0; i < nWorkers; i++)
+    {
+        auto &victim = workers[(first + i) % nWorkers];
+        if (&victim != worker && (job = pool_steal(victim.deque)) != nullptr)
+            return job;
+    }
+    return nullptr;
+}
+
+/* Run a job and wake whoever joins its group if it was the last one, the
+ * group can go away as soon as the lock is let go */
+static void pool_run(Pool::Job &job)
+{
+    auto &group = *job.group;
+    job.fn(job.data, job.begin, job.end);
+    auto flags = Task::Lock();
+    if (--group.pending == 0)
+        Task::WakeAll(group.waiters);
+    Task::Unlock(flags);
+}
+
+static void pool_worker_main()
+{
+    // It may run before Init puts it on the table
+    PoolWorker *worker;
+    while ((worker = pool_worker()) == nullptr)
+        Task::Switch();
+
+    while (1)
+    {
+        if (auto *job = pool_take(worker))
+            pool_run(*job);
+        else
+            work.Wait();
+    }
+}
+
+/// @brief Start a worker for each processor but the first one, nothing is
+/// started with a single processor online
+void Pool::Init()
+{
+    unsigned count = SMP::GetCount() - 1;
+    for (unsigned i = 0; i < count; i++)
+    {
+        workers[i].task = &Task::Add(&pool_worker_main, nullptr, false);
+        workers[i].task->name = "pool";
+        __atomic_store_n(&nWorkers, i + 1, __ATOMIC_RELEASE);
+    }
+    TTY::Print("pool: %u workers\n", count);
+}
+
+/// @brief Obtain the number of workers, 0 if the jobs run inline
+unsigned Pool::GetWorkers()
+{
+    return nWorkers;
+}
+
+/// @brief Queue a job on the group, it runs right away if there are no
+/// workers or no room for it
+void Pool::Spawn(Pool::Group &group, Pool::Job &job)
+{
+    job.group = &group;
+    if (nWorkers == 0)
+    {
+        job.fn(job.data, job.begin, job.end);
+        return;
+    }
+
+    auto flags = Task::Lock();
+    group.pending++;
+    Task::Unlock(flags);
+
+    bool queued;
+    if (auto *worker = pool_worker())
+        queued = pool_push(worker->deque, job);
+    else
+    {
+        queueLock.Lock();
+        queued = queueCount < POOL_QUEUE_SIZE;
+        if (queued)
+        {
+            queue[(queueHead + queueCount) % POOL_QUEUE_SIZE] = &job;
+            queueCount++;
+        }
+        queueLock.Unlock();
+    }
+
+    if (queued)
+        work.Signal();
+    else
+        pool_run(job);
+}
+
+/// @brief Wait for the jobs of the group to finish, running jobs meanwhile
+void Pool::Join(Pool::Group &group)
+{
+    auto *worker = pool_worker();
+    while (1)
+    {
+        auto flags = Task::Lock();
+        bool is_done = group.pending == 0;
+        Task::Unlock(flags);
+        if (is_done)
+            break;
+
+        if (auto *job = pool_take(worker))
+        {
+            pool_run(*job);
+            continue;
+        }
+
+        // The jobs left are running elsewhere
+        flags = Task::Lock();
+        if (group.pending != 0)
+            Task::Wait(group.waiters);
+        Task::Unlock(flags);
+    }
+}
+
+struct PoolRange
+{
+    void (*fn)(void *data, size_t begin, size_t end);
+    void *data;
+    size_t grain;
+};
+
+/* Give the upper half of the range away and go on with the lower half, the
+ * halves left are stolen from the top of the deque so the thieves get the
+ * biggest ones */
+static void pool_split(void *data, size_t begin, size_t end)
+{
+    auto &range = *static_cast<const PoolRange *>(data);
+    if (nWorkers == 0 || end - begin <= range.grain)
+    {
+        range.fn(range.data, begin, end);
+        return;
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    Pool::Group group;
+    Pool::Job job(&pool_split, data, middle, end);
+    Pool::Spawn(group, job);
+    pool_split(data, begin, middle);
+    Pool::Join(group);
+}
+
+/// @brief Call fn over [begin, end) split in ranges of about grain, spread
+/// over the workers
+void Pool::For(size_t begin, size_t end, size_t grain, void (*fn)(void *data, size_t begin, size_t end), void *data)
+{
+    if (begin >= end)
+        return;
+    PoolRange range{fn, data, grain != 0 ? grain : 1};
+    pool_split(&range, begin, end);
+}
@@ -0,0 +1,77 @@
+#ifndef POOL_HXX
+#define POOL_HXX 1
+
+#include <cstddef>
+#include <cstdint>
+#include "task.hxx"
+
+/// @brief Worker pool for data-parallel jobs
+/// There's a worker task for each processor but the first one, the task that
+/// spawns the jobs works on them too while it joins. Each worker keeps the
+/// jobs it spawns on a Chase-Lev deque, it takes the newest ones from the
+/// bottom while the others steal the oldest ones from the top. Jobs spawned
+/// by other tasks go on a shared queue. With a single processor online there
+/// are no workers and the jobs run right away on the task spawning them.
+namespace Pool
+{
+#define POOL_DEQUE_SIZE (64) // Jobs a worker can have spawned, a power of 2
+#define POOL_QUEUE_SIZE (64) // Jobs other tasks can have spawned
+
+struct Group;
+
+/// @brief Work to run on some worker, fn gets called with data and the range.
+/// It must stay alive until the group is joined
+struct Job
+{
+    Job() = default;
+    Job(void (*_fn)(void *, size_t, size_t), void *_data, size_t _begin = 0, size_t _end = 0)
+        : fn{_fn},
+          data{_data},
+          begin{_begin},
+          end{_end}
+    {
+
+    }
+    Job(Job &) = delete;
+    Job(Job &&) = delete;
+    Job &operator=(const Job &) = delete;
+
+    void (*fn)(void *data, size_t begin, size_t end) = nullptr;
+    void *data = nullptr;
+    size_t begin = 0;
+    size_t end = 0;
+    // Group the job was spawned on
+    Pool::Group *group = nullptr;
+};
+
+/// @brief Jobs that are joined together
+struct Group
+{
+    Group() = default;
+    Group(Group &) = delete;
+    Group(Group &&) = delete;
+    Group &operator=(const Group &) = delete;
+
+    // Jobs spawned that haven't finished
+    unsigned pending = 0;
+    Task::WaitQueue waiters;
+};
+
+void Init();
+unsigned GetWorkers();
+void Spawn(Pool::Group &group, Pool::Job &job);
+void Join(Pool::Group &group);
+void For(size_t begin, size_t end, size_t grain, void (*fn)(void *data, size_t begin, size_t end), void *data);
+
+/// @brief Call fn(from, to) over [begin, end) split in ranges of about grain,
+/// spread over the workers. Returns once all of them are done
+template <typename F>
+static inline void ParallelFor(size_t begin, size_t end, size_t grain, const F &fn)
+{
+    Pool::For(begin, end, grain, [](void *data, size_t from, size_t to) -> void {
+        (*static_cast<const F *>(data))(from, to);
+    }, const_cast<F *>(&fn));
+}
+}
+
+#endif
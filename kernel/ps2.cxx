@@ -1,4 +1,5 @@
 #include "ps2.hxx"
+#include "defer.hxx"
 
 PS2::Keyboard *PS2::g_ps2_keyboard = nullptr;
 PS2::Mouse *PS2::g_ps2_mouse = nullptr;
@@ -6,24 +7,35 @@ PS2::Mouse *PS2::g_ps2_mouse = nullptr;
 /// @brief Keyboard IRQ handler
 extern "C" void IntE9h_Handler()
 {
-    Task::DisableSwitch();
 #ifdef DEBUG
     TTY::Print("ps2: Handling IRQ E9 for keyboard\n");
 #endif
     auto &kb = PS2::Keyboard::Get();
-    kb.buf[kb.n_buf++] = kb.GetPollKey();
-    if (kb.n_buf >= sizeof(kb.buf))
-        kb.n_buf = 0;
-    kb.buf[kb.n_buf] = '\0';
-    Task::Schedule();
+    // Releases and modifiers come as 0, a full buffer drops the key
+    int ch = kb.GetPollKey();
+    size_t next = (kb.n_buf + 1) % sizeof(kb.buf);
+    if (ch != 0 && next != kb.n_read)
+    {
+        kb.buf[kb.n_buf] = ch;
+        kb.n_buf = next;
+        kb.keyEvent.Set();
+    }
+    Task::BoostInputReader();
     PIC::Get().EOI(1);
-    Task::EnableSwitch();
 }
 
+/* Redraw the cursor where the mouse is now, the moves that came meanwhile
+ * only get drawn once */
+static void ps2_move_cursor(void *)
+{
+    auto &mouse = PS2::Mouse::Get();
+    g_KFrameBuffer.MoveMouse(mouse.GetX(), mouse.GetY());
+}
+static Defer::Work moveCursor(&ps2_move_cursor, nullptr);
+
 /// @brief Mouse IRQ handler
 extern "C" void IntF4h_Handler()
 {
-    Task::DisableSwitch();
 #ifdef DEBUG
     TTY::Print("ps2: Handling IRQ F4 for mouse\n");
 #endif
@@ -33,8 +45,7 @@ extern "C" void IntF4h_Handler()
         mouse.x = g_KFrameBuffer.width - 8;
     if (mouse.y > g_KFrameBuffer.height - 8)
         mouse.y = g_KFrameBuffer.height - 8;
-    g_KFrameBuffer.MoveMouse(mouse.GetX(), mouse.GetY());
-    Task::Schedule();
+    Defer::Queue(moveCursor);
+    Task::BoostInputReader();
     PIC::Get().EOI(12);
-    Task::EnableSwitch();
 }
@@ -385,8 +385,12 @@ struct Keyboard
     static constexpr auto max_key_bufsize = 64;
     /// @brief Ringbuffer for storing keys
     char buf[max_key_bufsize] = {};
-    /// @brief Current index in ringbuffer
+    /// @brief Where the IRQ puts the next key
     size_t n_buf = 0;
+    /// @brief Where GetKey takes the next key from
+    size_t n_read = 0;
+    /// @brief Set by the IRQ when a key is put on the ringbuffer
+    Task::Event keyEvent{true};
 
     Keyboard(Controller &_controller)
         : controller{_controller}
@@ -451,12 +455,25 @@ struct Keyboard
         return 0;
     }
 
+    /// @brief Take a key from the ringbuffer
+    /// @return The key, 0 if there's none
     int GetKey()
     {
-        int ch = this->buf[this->n_buf];
-        this->buf[this->n_buf++] = '\0';
-        if (this->n_buf >= sizeof(this->buf))
-            this->n_buf = 0;
+        Task::SetInputReader(Task::GetCurrent());
+        if (this->n_read == this->n_buf)
+            return 0;
+        int ch = this->buf[this->n_read];
+        this->n_read = (this->n_read + 1) % sizeof(this->buf);
+        return ch;
+    }
+
+    /// @brief Block until a key is pressed
+    /// @return The key
+    int WaitKey()
+    {
+        int ch;
+        while ((ch = this->GetKey()) == 0)
+            this->keyEvent.Wait();
         return ch;
     }
 
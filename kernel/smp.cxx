@@ -0,0 +1,223 @@
+#include "smp.hxx"
+#include "acpi.hxx"
+#include "apic.hxx"
+#include "clock.hxx"
+#include "fpu.hxx"
+#include "task.hxx"
+#include "alloc.hxx"
+#include "sync.hxx"
+#include "tty.hxx"
+#include "vendor.hxx"
+
+#define LAPIC_ID 0x020
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+
+#define ICR_INIT (5 << 8)
+#define ICR_STARTUP (6 << 8)
+#define ICR_PENDING (1 << 12)
+#define ICR_ASSERT (1 << 14)
+#define ICR_LEVEL (1 << 15)
+
+#define MADT_TYPE_LAPIC 0
+#define MADT_TYPE_IOAPIC 1
+
+#define SMP_AP_STACK_SIZE (DEFAULT_STACK_SIZE * 2)
+#define SMP_START_TIMEOUT_MS 100
+
+struct MADT
+{
+    ACPI::Header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} PACKED;
+
+struct MADT_Entry
+{
+    uint8_t type;
+    uint8_t length;
+} PACKED;
+
+struct MADT_LAPIC
+{
+    MADT_Entry entry;
+    uint8_t acpi_id;
+    uint8_t apic_id;
+    uint32_t flags; // Bit 0 if it's enabled
+} PACKED;
+
+struct MADT_IOAPIC
+{
+    MADT_Entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} PACKED;
+
+// Filled in for each processor before it's started, see trampoline.S
+extern "C" uint8_t Kernel_APStart;
+extern "C" uint8_t Kernel_APGdt[6];
+extern "C" uint8_t Kernel_APIdt[6];
+extern "C" uint32_t Kernel_APStack;
+
+static SMP::CPU cpus[SMP_MAX_CPUS];
+static volatile unsigned nCPUs = 1;
+static uint8_t apicToCpu[256] = {};
+static uintptr_t ioapicBase = 0;
+
+static void smp_send_ipi(uint8_t apic_id, uint32_t command)
+{
+    auto flags = Sync::SaveIRQ();
+    APIC::Write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    APIC::Write(LAPIC_ICR_LOW, command);
+    while (APIC::Read(LAPIC_ICR_LOW) & ICR_PENDING)
+        asm volatile("pause");
+    Sync::RestoreIRQ(flags);
+}
+
+/* INIT, then two STARTUPs as the MP specification asks for */
+static bool smp_start(unsigned id)
+{
+    auto &master = HimemAlloc::Manager::GetDefault();
+    auto *stack = static_cast<uint8_t *>(HimemAlloc::AlignAlloc(master, SMP_AP_STACK_SIZE, 16));
+    if (stack == nullptr)
+        return false;
+    Kernel_APStack = (uintptr_t)stack + SMP_AP_STACK_SIZE;
+    // Everything it needs from the heap is made here, it has no task to
+    // block on the locks with until it's running its idle task
+    Task::AddCPU(id, stack + SMP_AP_STACK_SIZE);
+
+    uint8_t apic_id = cpus[id].apic_id;
+    uint32_t vector = SMP_TRAMPOLINE >> 12;
+    smp_send_ipi(apic_id, ICR_INIT | ICR_ASSERT | ICR_LEVEL);
+    Clock::Delay(10000000);
+    for (unsigned i = 0; i < 2 && !cpus[id].is_online; i++)
+    {
+        smp_send_ipi(apic_id, ICR_STARTUP | vector);
+        Clock::Delay(200000);
+    }
+
+    uint64_t until = Clock::Now() + (uint64_t)SMP_START_TIMEOUT_MS * 1000000;
+    while (!__atomic_load_n(&cpus[id].is_online, __ATOMIC_ACQUIRE) && Clock::Now() < until)
+        asm volatile("pause");
+    if (!cpus[id].is_online)
+    {
+        // It may still come up later and use the stack, so it's leaked
+        TTY::Print("smp: Processor %u (APIC %u) didn't start\n", id, apic_id);
+        return false;
+    }
+    return true;
+}
+
+/// @brief Find the processors on the MADT and start them, the local APIC of
+/// the boot processor has to be enabled and the clock calibrated
+void SMP::Init()
+{
+    cpus[0].apic_id = APIC::Read(LAPIC_ID) >> 24;
+    cpus[0].is_online = true;
+
+    if ((uintptr_t)&Kernel_APStart != SMP_TRAMPOLINE)
+    {
+        TTY::Print("smp: Trampoline at %p instead of %p\n", &Kernel_APStart, SMP_TRAMPOLINE);
+        return;
+    }
+
+    auto *madt = reinterpret_cast<const MADT *>(ACPI::FindTable("APIC"));
+    if (madt == nullptr || !APIC::IsEnabled())
+    {
+        TTY::Print("smp: No MADT, running on the boot processor only\n");
+        return;
+    }
+
+    unsigned found = 1;
+    auto *entry = reinterpret_cast<const uint8_t *>(madt + 1);
+    auto *end = reinterpret_cast<const uint8_t *>(madt) + madt->header.length;
+    while (entry + sizeof(MADT_Entry) <= end)
+    {
+        auto &header = *reinterpret_cast<const MADT_Entry *>(entry);
+        if (header.length < sizeof(MADT_Entry))
+            break;
+
+        if (header.type == MADT_TYPE_LAPIC)
+        {
+            auto &lapic = *reinterpret_cast<const MADT_LAPIC *>(entry);
+            if ((lapic.flags & 1) && lapic.apic_id != cpus[0].apic_id)
+            {
+                if (found < SMP_MAX_CPUS)
+                    cpus[found++].apic_id = lapic.apic_id;
+                else
+                    TTY::Print("smp: Ignoring processor with APIC %u\n", lapic.apic_id);
+            }
+        }
+        else if (header.type == MADT_TYPE_IOAPIC && ioapicBase == 0)
+        {
+            auto &ioapic = *reinterpret_cast<const MADT_IOAPIC *>(entry);
+            ioapicBase = ioapic.address;
+            TTY::Print("smp: I/O APIC %u at %p, GSI %u\n", ioapic.id, ioapic.address, ioapic.gsi_base);
+        }
+        entry += header.length;
+    }
+
+    asm volatile("\tsgdt %0\r\n"
+                 "\tsidt %1\r\n"
+                 : "=m"(Kernel_APGdt), "=m"(Kernel_APIdt));
+    // The processors are numbered as they come up, the ones that don't are
+    // skipped over
+    for (unsigned i = 1; i < found; i++)
+    {
+        unsigned id = nCPUs;
+        cpus[id].apic_id = cpus[i].apic_id;
+        cpus[id].is_online = false;
+        apicToCpu[cpus[id].apic_id] = id;
+        if (smp_start(id))
+            nCPUs = id + 1;
+    }
+    TTY::Print("smp: %u of %u processors online\n", nCPUs, found);
+}
+
+/// @brief Obtain the number of the running processor
+unsigned SMP::GetId()
+{
+    if (!APIC::IsEnabled())
+        return 0;
+    return apicToCpu[APIC::Read(LAPIC_ID) >> 24];
+}
+
+/// @brief Obtain the number of processors online
+unsigned SMP::GetCount()
+{
+    return nCPUs;
+}
+
+/// @brief Interrupt a processor so it looks at its queues again
+void SMP::Kick(unsigned cpu)
+{
+    if (cpu >= nCPUs || cpu == SMP::GetId())
+        return;
+    smp_send_ipi(cpus[cpu].apic_id, SMP_KICK_VECTOR | ICR_ASSERT);
+}
+
+/// @brief Obtain the address of the first I/O APIC, 0 if there's none. The
+/// interrupts still go through the PIC
+uintptr_t SMP::GetIOAPIC()
+{
+    return ioapicBase;
+}
+
+/* Where the other processors land after the trampoline, on the stack the
+ * boot processor gave them */
+extern "C" void Kernel_APMain()
+{
+    unsigned id = apicToCpu[APIC::Read(LAPIC_ID) >> 24];
+    APIC::Init();
+    FPU::Init();
+    // The boot processor goes on to the next one once this one is online
+    __atomic_store_n(&cpus[id].is_online, true, __ATOMIC_RELEASE);
+    Task::StartCPU(id);
+}
+
+extern "C" void IntF9h_Handler()
+{
+    APIC::EOI();
+}
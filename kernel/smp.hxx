@@ -0,0 +1,31 @@
+#ifndef SMP_HXX
+#define SMP_HXX 1
+
+#include <cstdint>
+
+#define SMP_MAX_CPUS (8)
+#define SMP_KICK_VECTOR (0xF9) // Wakes a processor up to look at its queues
+#define SMP_TRAMPOLINE (0x8000) // Where the other processors start, real mode
+
+/// @brief Multiple processors
+/// The processors are found on the MADT and numbered in the order they come
+/// up, the boot processor is 0. The interrupts of devices are only delivered
+/// to the boot processor, the others only get kicked out of their idle loops
+namespace SMP
+{
+struct CPU
+{
+    uint8_t apic_id = 0;
+    bool is_online = false;
+};
+
+void Init();
+unsigned GetId();
+unsigned GetCount();
+void Kick(unsigned cpu);
+uintptr_t GetIOAPIC();
+}
+
+extern "C" void IntF9h_Handler();
+
+#endif
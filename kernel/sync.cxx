@@ -0,0 +1,179 @@
+#include "sync.hxx"
+
+void Sync::Spinlock::Lock()
+{
+    uint32_t flags = Sync::SaveIRQ();
+    while (__atomic_test_and_set(&this->locked, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+    this->flags = flags;
+}
+
+void Sync::Spinlock::Unlock()
+{
+    uint32_t flags = this->flags;
+    __atomic_clear(&this->locked, __ATOMIC_RELEASE);
+    Sync::RestoreIRQ(flags);
+}
+
+/// @brief Take the mutex, sleeping while another task holds it
+void Sync::Mutex::Lock()
+{
+    auto flags = Task::Lock();
+    auto *task = Task::PeekCurrent();
+    if (this->depth != 0 && this->owner == task)
+    {
+        this->depth++;
+        Task::Unlock(flags);
+        return;
+    }
+
+    while (this->depth != 0)
+    {
+        // Don't let tasks of a priority between ours and the one of the
+        // holder keep it from running
+        if (this->owner != nullptr && task != nullptr && this->owner->priority > task->priority)
+            Task::InheritPriority(*this->owner, task->priority);
+        Task::Wait(this->waiters);
+    }
+    this->owner = task;
+    this->depth = 1;
+    Task::Unlock(flags);
+}
+
+/// @brief Take the mutex if it's free or already ours
+/// @return false if another task holds it
+bool Sync::Mutex::TryLock()
+{
+    auto flags = Task::Lock();
+    auto *task = Task::PeekCurrent();
+    bool taken = this->depth == 0 || this->owner == task;
+    if (taken)
+    {
+        this->owner = task;
+        this->depth++;
+    }
+    Task::Unlock(flags);
+    return taken;
+}
+
+/// @brief Let go of the mutex, the holder gets its own priority back when
+/// it's fully unlocked
+void Sync::Mutex::Unlock()
+{
+    auto flags = Task::Lock();
+    if (--this->depth == 0)
+    {
+        if (this->owner != nullptr)
+            Task::RestorePriority(*this->owner);
+        this->owner = nullptr;
+        Task::WakeOne(this->waiters);
+    }
+    Task::Unlock(flags);
+}
+
+/// @brief Take a unit, sleeping until there's one
+/// @param timeout Ticks to give up after, 0 to wait forever
+/// @return false if it timed out
+bool Sync::Semaphore::Wait(unsigned timeout)
+{
+    auto flags = Task::Lock();
+    uint32_t until = Task::GetTicks() + timeout;
+    while (this->count == 0)
+    {
+        unsigned left = 0;
+        if (timeout != 0)
+        {
+            if ((int32_t)(until - Task::GetTicks()) <= 0)
+            {
+                Task::Unlock(flags);
+                return false;
+            }
+            left = until - Task::GetTicks();
+        }
+        Task::Wait(this->waiters, left);
+    }
+    this->count--;
+    Task::Unlock(flags);
+    return true;
+}
+
+bool Sync::Semaphore::TryWait()
+{
+    auto flags = Task::Lock();
+    bool taken = this->count != 0;
+    if (taken)
+        this->count--;
+    Task::Unlock(flags);
+    return taken;
+}
+
+void Sync::Semaphore::Signal()
+{
+    auto flags = Task::Lock();
+    this->count++;
+    Task::WakeOne(this->waiters);
+    Task::Unlock(flags);
+}
+
+/// @brief Take the lock for writing
+void Sync::RWLock::Lock()
+{
+    auto flags = Task::Lock();
+    auto *task = Task::PeekCurrent();
+    if (this->depth != 0 && this->writer == task)
+    {
+        this->depth++;
+        Task::Unlock(flags);
+        return;
+    }
+
+    this->writers_waiting++;
+    while (this->depth != 0 || this->readers != 0)
+        Task::Wait(this->writeQueue);
+    this->writers_waiting--;
+    this->writer = task;
+    this->depth = 1;
+    Task::Unlock(flags);
+}
+
+void Sync::RWLock::Unlock()
+{
+    auto flags = Task::Lock();
+    if (--this->depth == 0)
+    {
+        this->writer = nullptr;
+        if (this->writers_waiting != 0)
+            Task::WakeOne(this->writeQueue);
+        else
+            Task::WakeAll(this->readQueue);
+    }
+    Task::Unlock(flags);
+}
+
+/// @brief Take the lock for reading
+void Sync::RWLock::LockShared()
+{
+    auto flags = Task::Lock();
+    auto *task = Task::PeekCurrent();
+    if (this->depth != 0 && this->writer == task)
+    {
+        this->depth++;
+        Task::Unlock(flags);
+        return;
+    }
+
+    while (this->depth != 0 || this->writers_waiting != 0)
+        Task::Wait(this->readQueue);
+    this->readers++;
+    Task::Unlock(flags);
+}
+
+void Sync::RWLock::UnlockShared()
+{
+    auto flags = Task::Lock();
+    if (this->depth != 0 && this->writer == Task::PeekCurrent())
+        this->depth--;
+    else if (--this->readers == 0 && this->writers_waiting != 0)
+        Task::WakeOne(this->writeQueue);
+    Task::Unlock(flags);
+}
@@ -0,0 +1,154 @@
+#ifndef SYNC_HXX
+#define SYNC_HXX 1
+
+#include <cstdint>
+#include "task.hxx"
+
+/// @brief Locking primitives
+/// Spinlocks keep the interrupts off while held so they can be taken by the
+/// interrupt handlers, the other locks put the waiting tasks to sleep and can
+/// only be used by tasks. Their state is kept under the lock of the scheduler
+/// so they hold up across processors. Until the first task is added the
+/// kernel is the only thread and the sleeping locks are always free for it.
+namespace Sync
+{
+/// @brief Disable the interrupts
+/// @return The flags to give to RestoreIRQ
+static inline uint32_t SaveIRQ()
+{
+    uint32_t flags;
+    asm volatile("\tpushfl\r\n"
+                 "\tpopl %0\r\n"
+                 "\tcli\r\n"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+/// @brief Enable the interrupts back if they were enabled by SaveIRQ
+static inline void RestoreIRQ(uint32_t flags)
+{
+    asm volatile("\tpushl %0\r\n"
+                 "\tpopfl\r\n"
+                 :
+                 : "r"(flags)
+                 : "memory", "cc");
+}
+
+/// @brief Lock for short sections shared with the interrupt handlers, the
+/// holder must not switch tasks
+struct Spinlock
+{
+    Spinlock() = default;
+    Spinlock(Spinlock &) = delete;
+    Spinlock(Spinlock &&) = delete;
+    Spinlock &operator=(const Spinlock &) = delete;
+
+    void Lock();
+    void Unlock();
+
+    bool locked = false;
+    uint32_t flags = 0; // Interrupt state from before Lock
+};
+
+/// @brief Sleeping lock that can be taken again by its holder. A task
+/// waiting on it lends its priority to the holder until it's unlocked
+struct Mutex
+{
+    Mutex() = default;
+    Mutex(Mutex &) = delete;
+    Mutex(Mutex &&) = delete;
+    Mutex &operator=(const Mutex &) = delete;
+
+    void Lock();
+    bool TryLock();
+    void Unlock();
+
+    Task::TSS *owner = nullptr;
+    unsigned depth = 0;
+    Task::WaitQueue waiters;
+};
+
+/// @brief Counting semaphore, Signal can be called from interrupt handlers
+struct Semaphore
+{
+    Semaphore() = default;
+    explicit Semaphore(unsigned _count)
+        : count{_count}
+    {
+
+    }
+    Semaphore(Semaphore &) = delete;
+    Semaphore(Semaphore &&) = delete;
+    Semaphore &operator=(const Semaphore &) = delete;
+
+    bool Wait(unsigned timeout = 0);
+    bool TryWait();
+    void Signal();
+
+    unsigned count = 0;
+    Task::WaitQueue waiters;
+};
+
+/// @brief Many readers or a single writer, waiting writers go before new
+/// readers. The writer can take it again, for writing or for reading
+struct RWLock
+{
+    RWLock() = default;
+    RWLock(RWLock &) = delete;
+    RWLock(RWLock &&) = delete;
+    RWLock &operator=(const RWLock &) = delete;
+
+    void Lock();
+    void Unlock();
+    void LockShared();
+    void UnlockShared();
+
+    Task::TSS *writer = nullptr;
+    unsigned depth = 0; // Times taken by the writer, 0 if there's none
+    unsigned readers = 0;
+    unsigned writers_waiting = 0;
+    Task::WaitQueue readQueue;
+    Task::WaitQueue writeQueue;
+};
+
+/// @brief Holds a lock while alive
+template <typename T>
+struct LockGuard
+{
+    explicit LockGuard(T &_lock)
+        : lock{_lock}
+    {
+        this->lock.Lock();
+    }
+    LockGuard(LockGuard &) = delete;
+    LockGuard(LockGuard &&) = delete;
+    ~LockGuard()
+    {
+        this->lock.Unlock();
+    }
+
+    T &lock;
+};
+
+/// @brief Holds a reader/writer lock for reading while alive
+struct SharedGuard
+{
+    explicit SharedGuard(RWLock &_lock)
+        : lock{_lock}
+    {
+        this->lock.LockShared();
+    }
+    SharedGuard(SharedGuard &) = delete;
+    SharedGuard(SharedGuard &&) = delete;
+    ~SharedGuard()
+    {
+        this->lock.UnlockShared();
+    }
+
+    RWLock &lock;
+};
+}
+
+#endif
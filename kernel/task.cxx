@@ -1,238 +1,1193 @@
 #include <cstddef>
+#include <new>
 #include "task.hxx"
 #include "gdt.hxx"
+#include "alloc.hxx"
+#include "sync.hxx"
+#include "pit.hxx"
+#include "clock.hxx"
+#include "clockevent.hxx"
+#include "smp.hxx"
+#include "fpu.hxx"
+#include "defer.hxx"
 #include "tty.hxx"
 #include "assert.hxx"
 
-static struct Task::TSS tasks[MAX_TASKS] = {};
-static size_t n_task = 0;
-static bool canSwitch = true;
-static Task::StackInfo stacks[MAX_TASKS] = {};
+/// @brief Tasks waiting for the processor, a FIFO per priority level and a
+/// bitmap of the levels that have tasks so picking the next one takes a scan
+/// of a single word
+struct Task::RunQueue
+{
+    uint32_t bitmap = 0;
+    unsigned count = 0;
+    Task::TSS *head[NUM_PRIORITIES] = {};
+    Task::TSS *tail[NUM_PRIORITIES] = {};
+};
+static_assert(NUM_PRIORITIES <= 32);
+
+/* Scheduling state of a processor, tasks are queued on the processor they
+ * last ran on and the idle ones take tasks from the busy ones */
+struct TaskCPU
+{
+    // Running task
+    Task::TSS *current = nullptr;
+    // TSS loaded on the task register, only used for ring transitions and on
+    // the boot processor for the hardware switches to v86 tasks
+    Task::TSS *hw_task = nullptr;
+    // Runs when no other task is ready, it's never on the ready queues
+    Task::TSS *idle = nullptr;
+    // Tasks that spent their slice go to the expired queue, they get to run
+    // again once the active one is empty and the queues are swapped
+    Task::RunQueue queues[2];
+    unsigned active = 0;
+    // Times the processor took the task lock, it holds it while it isn't 0
+    unsigned lock_depth = 0;
+    // Cleared to keep the running task on the processor, see DisableSwitch
+    bool can_switch = true;
+    uint64_t idle_time = 0; // Nanoseconds spent halted
+};
+static TaskCPU cpus[SMP_MAX_CPUS];
+static bool taskLock = false;
+// Every task is on a circular list, ready or not
+static Task::TSS *taskList = nullptr;
+// Finished tasks, freed by the defer task once they're off their stacks
+static Task::RunQueue deadQueue;
+// Task that last read the keyboard, boosted when input comes in
+static Task::TSS *inputReader = nullptr;
+static volatile uint32_t ticks = 0;
 
 extern "C" void Kernel_EnterV86(uint32_t ss, uint32_t esp, uint32_t cs, uint32_t eip);
+extern "C" void Kernel_SwitchContext(Task::Context *from, const Task::Context *to);
+extern "C" void Kernel_SwitchBounce();
 extern uint8_t g_KernStackTop;
 
-Task::TSS &Task::Schedule()
+static inline TaskCPU &task_cpu()
+{
+    return cpus[SMP::GetId()];
+}
+
+static inline Task::RunQueue &task_active(TaskCPU &cpu)
+{
+    return cpu.queues[cpu.active];
+}
+
+static inline Task::RunQueue &task_expired(TaskCPU &cpu)
+{
+    return cpu.queues[cpu.active ^ 1];
+}
+
+/* Tasks ready to run on the processor, the running one included */
+static inline unsigned task_load(const TaskCPU &cpu)
+{
+    return cpu.queues[0].count + cpu.queues[1].count + (cpu.current != cpu.idle ? 1 : 0);
+}
+
+static bool task_is_running(const Task::TSS &task)
+{
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+        if (cpus[i].current == &task)
+            return true;
+    return false;
+}
+
+static inline bool task_is_ready(const Task::TSS &task)
+{
+    return task.queue != nullptr && task.queue != &deadQueue;
+}
+
+static inline void task_lock_take()
+{
+    while (__atomic_test_and_set(&taskLock, __ATOMIC_ACQUIRE))
+        asm volatile("pause");
+}
+
+/// @brief Take the lock of the scheduler, shared by every processor. The
+/// processor holding it can take it again, the interrupts stay off while
+/// it's held. It's held across a switch and let go by the task switched to
+/// @return The flags to give to Unlock
+uint32_t Task::Lock()
+{
+    auto flags = Sync::SaveIRQ();
+    if (task_cpu().lock_depth++ == 0)
+        task_lock_take();
+    return flags;
+}
+
+void Task::Unlock(uint32_t flags)
+{
+    if (--task_cpu().lock_depth == 0)
+        __atomic_clear(&taskLock, __ATOMIC_RELEASE);
+    Sync::RestoreIRQ(flags);
+}
+
+/* New tasks start here with the lock taken by the task that switched to
+ * them, see Kernel_TaskStart */
+extern "C" void Kernel_TaskStarted()
+{
+    task_cpu().lock_depth = 0;
+    __atomic_clear(&taskLock, __ATOMIC_RELEASE);
+}
+
+static inline unsigned task_level(const Task::TSS &task)
 {
-    assert(n_task < MAX_TASKS);
-    // Search for tasks after
-    for (size_t i = n_task + 1; i < MAX_TASKS; i++)
+    return task.priority - (task.boost < task.priority ? task.boost : task.priority);
+}
+
+static inline uint8_t task_slice(const Task::TSS &task)
+{
+    return MIN_SLICE_TICKS + (MAX_SLICE_TICKS - MIN_SLICE_TICKS) * (PRIORITY_IDLE - task.priority) / PRIORITY_IDLE;
+}
+
+static void task_enqueue(Task::RunQueue &queue, Task::TSS &task)
+{
+    unsigned level = task_level(task);
+    task.queue = &queue;
+    task.level = level;
+    task.run_next = nullptr;
+    task.run_prev = queue.tail[level];
+    if (queue.tail[level] != nullptr)
+        queue.tail[level]->run_next = &task;
+    else
+        queue.head[level] = &task;
+    queue.tail[level] = &task;
+    queue.bitmap |= 1u << level;
+    queue.count++;
+}
+
+static void task_unqueue(Task::TSS &task)
+{
+    auto &queue = *task.queue;
+    unsigned level = task.level;
+    if (task.run_prev != nullptr)
+        task.run_prev->run_next = task.run_next;
+    else
+        queue.head[level] = task.run_next;
+    if (task.run_next != nullptr)
+        task.run_next->run_prev = task.run_prev;
+    else
+        queue.tail[level] = task.run_prev;
+    if (queue.head[level] == nullptr)
+        queue.bitmap &= ~(1u << level);
+    queue.count--;
+    task.queue = nullptr;
+    task.run_next = task.run_prev = nullptr;
+}
+
+/* Work of the defer task, frees the finished tasks. It can't be done by the
+ * task itself since it's still running on its stack, nor by the scheduler
+ * since the heap lock sleeps. So they're taken off everything with the lock
+ * held and their memory goes back once it's let go */
+static void task_reap(void *)
+{
+    Task::TSS *list = nullptr;
+    auto flags = Task::Lock();
+    while (deadQueue.bitmap != 0)
+    {
+        auto &task = *deadQueue.head[__builtin_ctz(deadQueue.bitmap)];
+        task_unqueue(task);
+        Timer::Cancel(task.alarm);
+        if (inputReader == &task)
+            inputReader = nullptr;
+        if (taskList == &task)
+            taskList = task.next;
+        task.prev->next = task.next;
+        task.next->prev = task.prev;
+        GDT::FreeEntry(GDT::GetEntry(task.tss_segment));
+        GDT::FreeEntry(GDT::GetEntry(task.ldt_segment));
+        task.run_next = list;
+        list = &task;
+    }
+    Task::Unlock(flags);
+
+    auto &master = HimemAlloc::Manager::GetDefault();
+    while (list != nullptr)
+    {
+        auto &task = *list;
+        list = task.run_next;
+        FPU::Release(task);
+        HimemAlloc::Free(master, task.stack);
+        HimemAlloc::Free(master, &task);
+    }
+}
+static Defer::Work reapWork(&task_reap, nullptr);
+
+/* Put a task that has finished aside for task_reap, it must no longer be
+ * running once the lock is let go. The one on the task register stays for
+ * the ring transitions */
+static void task_bury(TaskCPU &cpu, Task::TSS &task)
+{
+    if (&task == cpu.hw_task)
+        return;
+    task_enqueue(deadQueue, task);
+    Defer::Queue(reapWork);
+}
+
+/* Take the first task of the highest level that has one */
+static Task::TSS *task_pick(TaskCPU &cpu)
+{
+    while (1)
     {
-        auto &task = tasks[i];
-        if (!task.is_active) // Must be active
-            continue;
-        n_task = i;
+        if (task_active(cpu).bitmap == 0)
+        {
+            if (task_expired(cpu).bitmap == 0)
+                return nullptr;
+            cpu.active ^= 1;
+        }
 
-        // Make task segment available again
-        auto &task_entry = GDT::GetEntry(task.tss_segment);
-        if (!task.is_v86)
-            task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
+        auto &queue = task_active(cpu);
+        auto *task = queue.head[__builtin_ctz(queue.bitmap)];
+        task_unqueue(*task);
+        if (task->is_active)
+            return task;
+        task_bury(cpu, *task);
+    }
+}
+
+/* Task the processor can take from the one with the most tasks ready, the
+ * pinned ones stay. Nothing is taken from a processor with a single task */
+static Task::TSS *task_find_steal(TaskCPU &cpu)
+{
+    TaskCPU *busiest = nullptr;
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+    {
+        auto &other = cpus[i];
+        if (&other != &cpu && task_load(other) > 1
+            && (busiest == nullptr || task_load(other) > task_load(*busiest)))
+            busiest = &other;
+    }
+    if (busiest == nullptr)
+        return nullptr;
+
+    for (auto *queue : {&task_active(*busiest), &task_expired(*busiest)})
+    {
+        for (uint32_t levels = queue->bitmap; levels != 0; levels &= levels - 1)
+        {
+            for (auto *task = queue->head[__builtin_ctz(levels)]; task != nullptr; task = task->run_next)
+            {
+                if (!task->is_pinned && task->is_active)
+                    return task;
+            }
+        }
+    }
+    return nullptr;
+}
+
+/* Processor a task that became ready goes to, the one it last ran on unless
+ * another one has less to do */
+static unsigned task_select_cpu(const Task::TSS &task)
+{
+    unsigned best = task.cpu;
+    if (task.is_pinned)
+        return best;
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+        if (task_load(cpus[i]) < task_load(cpus[best]))
+            best = i;
+    return best;
+}
+
+/* Queue a task that became ready, the processor it goes to is kicked out of
+ * its idle task */
+static void task_ready(Task::TSS &task)
+{
+    unsigned id = task_select_cpu(task);
+    auto &cpu = cpus[id];
+    task.cpu = id;
+    task.ready_since = Clock::Now();
+    task_enqueue(task_active(cpu), task);
+    if (cpu.current == cpu.idle)
+        SMP::Kick(id);
+}
+
+/* Charge the run that ends to the task going out and start the one of the
+ * task coming in, its wait since it was woken goes on its histogram */
+static void task_account(Task::TSS &prev, Task::TSS &next)
+{
+    uint64_t now = Clock::Now();
+    prev.run_time += now - prev.run_start;
+    if (prev.wait_queue != nullptr || !prev.is_active)
+        prev.n_voluntary++;
+    else
+        prev.n_involuntary++;
+
+    next.run_start = now;
+    if (next.ready_since == 0)
+        return;
+    uint64_t us = UDiv64(now - next.ready_since, 1000);
+    unsigned bucket = us >> 32 != 0 ? TASK_LATENCY_BUCKETS : us != 0 ? 32 - __builtin_clz((uint32_t)us) : 0;
+    if (bucket >= TASK_LATENCY_BUCKETS)
+        bucket = TASK_LATENCY_BUCKETS - 1;
+    next.latency[bucket]++;
+    next.ready_since = 0;
+}
+
+/// @brief Pick the next task to run on this processor, the current one goes
+/// back to the ready queues. It's the idle task if no other is ready, or the
+/// current task before there's an idle task
+Task::TSS &Task::Schedule()
+{
+    auto flags = Task::Lock();
+    auto &cpu = task_cpu();
+    assert(cpu.current != nullptr);
+    auto &prev = *cpu.current;
+    if (&prev != cpu.idle && prev.queue == nullptr && prev.wait_queue == nullptr)
+    {
+        if (!prev.is_active)
+            task_bury(cpu, prev);
+        else if (prev.slice == 0)
+        {
+            // A task that spent its slice waits for the others to spend
+            // theirs, interactive tasks come back down as they do
+            if (prev.boost != 0)
+                prev.boost--;
+            prev.slice = task_slice(prev);
+            task_enqueue(task_expired(cpu), prev);
+        }
         else
-            task_entry.SetAccess(0x80 | GDT::Entry::TYPE_16TSS_AVAIL);
-        return task;
+            task_enqueue(task_active(cpu), prev);
     }
 
-    // Search for tasks before
-    for (size_t i = 0; i < n_task; i++)
+    auto *next = task_pick(cpu);
+    if (next == nullptr && (next = task_find_steal(cpu)) != nullptr)
+        task_unqueue(*next);
+    if (next == nullptr)
+        next = cpu.idle;
+    if (next != nullptr)
     {
-        auto &task = tasks[i];
-        if (!task.is_active) // Must be active
-            continue;
-        n_task = i;
+        if (next != &prev)
+            task_account(prev, *next);
+        cpu.current = next;
+        next->cpu = &cpu - cpus;
+    }
+    else if (prev.queue != nullptr)
+        task_unqueue(prev); // Still running, even if it has finished
+    Task::Unlock(flags);
+    return *cpu.current;
+}
+
+/* Take the task off its wait queue and make it ready, tasks that block
+ * get boosted like interactive ones */
+static void task_wake(Task::TSS &task)
+{
+    auto &queue = *task.wait_queue;
+    Task::TSS *prev = nullptr;
+    for (auto *waiter = queue.head; waiter != &task; waiter = waiter->wait_next)
+        prev = waiter;
+    if (prev != nullptr)
+        prev->wait_next = task.wait_next;
+    else
+        queue.head = task.wait_next;
+    if (queue.tail == &task)
+        queue.tail = prev;
+    task.wait_queue = nullptr;
+    task.wait_next = nullptr;
 
-        // Make task segment available again
-        auto &task_entry = GDT::GetEntry(task.tss_segment);
-        if (!task.is_v86)
-            task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
+    Timer::Cancel(task.alarm);
+
+    if (task_is_running(task))
+        return;
+    if (task.boost < MAX_BOOST)
+        task.boost++;
+    if (task.slice == 0)
+        task.slice = task_slice(task);
+    task_ready(task);
+}
+
+/* Block the running task until it's woken or timeout ticks pass, must be
+ * called with the lock held. When no other task can run the lock is let go
+ * and the interrupts are let in for a moment instead, so callers have to
+ * check for what they're waiting for again */
+static void task_block(Task::WaitQueue &queue, unsigned timeout, uint32_t flags)
+{
+    auto &task = *task_cpu().current;
+    if (task_cpu().can_switch)
+    {
+        task.wait_queue = &queue;
+        task.wait_next = nullptr;
+        if (queue.tail != nullptr)
+            queue.tail->wait_next = &task;
         else
-            task_entry.SetAccess(0x80 | GDT::Entry::TYPE_16TSS_AVAIL);
-        return task;
+            queue.head = &task;
+        queue.tail = &task;
+        if (timeout != 0)
+            Timer::Arm(task.alarm, timeout);
+
+        auto &next = Task::Schedule();
+        if (&next != &task)
+        {
+            Task::SwitchTo(task, next);
+            return;
+        }
+        task_wake(task);
     }
-    __builtin_unreachable();
+    // All of it, the caller may have taken it more than once
+    unsigned depth = task_cpu().lock_depth;
+    task_cpu().lock_depth = 0;
+    __atomic_clear(&taskLock, __ATOMIC_RELEASE);
+    Sync::RestoreIRQ(flags);
+    IO_Wait();
+    Sync::SaveIRQ();
+    task_lock_take();
+    task_cpu().lock_depth = depth;
+}
+
+/* Alarm of a timed wait, the task may have been woken already */
+static void task_timeout(void *data)
+{
+    auto &task = *static_cast<Task::TSS *>(data);
+    auto flags = Task::Lock();
+    if (task.wait_queue != nullptr)
+        task_wake(task);
+    Task::Unlock(flags);
+}
+
+/// @brief Spend a tick of the slices of the running tasks, called by the timer.
+/// The timed waits that ran out are woken by the alarms run afterwards
+void Task::Tick()
+{
+    auto flags = Task::Lock();
+    __atomic_add_fetch(&ticks, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+    {
+        auto *task = cpus[i].current;
+        if (task != nullptr && task->slice != 0)
+            task->slice--;
+    }
+    Task::Unlock(flags);
+}
+
+/// @brief Ticks of the timer since it started
+uint32_t Task::GetTicks()
+{
+    return ticks;
+}
+
+/// @brief Block the running task on the queue until it's woken
+/// @param queue Queue to wait on
+/// @param timeout Ticks to give up after, 0 to wait forever
+void Task::Wait(Task::WaitQueue &queue, unsigned timeout)
+{
+    auto flags = Task::Lock();
+    task_block(queue, timeout, flags);
+    Task::Unlock(flags);
+}
+
+/// @brief Wake the task that has waited the longest on the queue
+/// @return false if no task was waiting
+bool Task::WakeOne(Task::WaitQueue &queue)
+{
+    auto flags = Task::Lock();
+    bool woken = queue.head != nullptr;
+    if (woken)
+        task_wake(*queue.head);
+    Task::Unlock(flags);
+    return woken;
+}
+
+void Task::WakeAll(Task::WaitQueue &queue)
+{
+    auto flags = Task::Lock();
+    while (queue.head != nullptr)
+        task_wake(*queue.head);
+    Task::Unlock(flags);
+}
+
+void Task::Event::Set()
+{
+    auto flags = Task::Lock();
+    this->is_set = true;
+    if (this->auto_reset)
+        Task::WakeOne(this->waiters);
+    else
+        Task::WakeAll(this->waiters);
+    Task::Unlock(flags);
+}
+
+void Task::Event::Reset()
+{
+    this->is_set = false;
+}
+
+/// @brief Block until the event is set
+/// @param timeout Ticks to give up after, 0 to wait forever
+/// @return false if it timed out
+bool Task::Event::Wait(unsigned timeout)
+{
+    auto flags = Task::Lock();
+    uint32_t until = ticks + timeout;
+    while (!this->is_set)
+    {
+        unsigned left = 0;
+        if (timeout != 0)
+        {
+            if ((int32_t)(until - ticks) <= 0)
+            {
+                Task::Unlock(flags);
+                return false;
+            }
+            left = until - ticks;
+        }
+        task_block(this->waiters, left, flags);
+    }
+    if (this->auto_reset)
+        this->is_set = false;
+    Task::Unlock(flags);
+    return true;
+}
+
+/* Move a task that's ready to the level of its new priority */
+static void task_set_priority(Task::TSS &task, unsigned priority)
+{
+    task.priority = priority;
+    if (task_is_ready(task))
+    {
+        auto &queue = *task.queue;
+        task_unqueue(task);
+        task_enqueue(queue, task);
+    }
+}
+
+/// @brief Set the priority of a task, the time slices are longer the higher
+/// the priority is
+void Task::SetPriority(Task::TSS &task, unsigned priority)
+{
+    if (priority > PRIORITY_IDLE)
+        priority = PRIORITY_IDLE;
+
+    auto flags = Task::Lock();
+    // A priority lent by a mutex waiter stays until the mutex is unlocked
+    bool lent = task.priority < task.base_priority;
+    task.base_priority = priority;
+    if (!lent || priority < task.priority)
+        task_set_priority(task, priority);
+    Task::Unlock(flags);
+}
+
+/// @brief Raise a task to at least the given priority until RestorePriority
+void Task::InheritPriority(Task::TSS &task, unsigned priority)
+{
+    auto flags = Task::Lock();
+    if (priority < task.priority)
+        task_set_priority(task, priority);
+    Task::Unlock(flags);
+}
+
+/// @brief Drop the priority lent by InheritPriority, all of it even if
+/// the task holds more than one mutex
+void Task::RestorePriority(Task::TSS &task)
+{
+    auto flags = Task::Lock();
+    if (task.priority != task.base_priority)
+        task_set_priority(task, task.base_priority);
+    Task::Unlock(flags);
+}
+
+/// @brief Raise a task that got input, it's run before the tasks of its
+/// priority even if it already spent its slice
+void Task::Boost(Task::TSS &task)
+{
+    auto flags = Task::Lock();
+    task.boost = MAX_BOOST;
+    if (task_is_ready(task))
+    {
+        task_unqueue(task);
+        if (task.slice == 0)
+            task.slice = task_slice(task);
+        task_enqueue(task_active(cpus[task.cpu]), task);
+    }
+    Task::Unlock(flags);
+}
+
+/// @brief Make a task the one boosted when input comes in, the UI or the
+/// shell as they read the keyboard. It's forgotten once the task finishes
+void Task::SetInputReader(Task::TSS &task)
+{
+    auto flags = Task::Lock();
+    inputReader = &task;
+    Task::Unlock(flags);
+}
+
+/// @brief Boost the task that last read the keyboard, if it's still there,
+/// called by the input interrupt handlers
+void Task::BoostInputReader()
+{
+    auto flags = Task::Lock();
+    if (inputReader != nullptr)
+        Task::Boost(*inputReader);
+    Task::Unlock(flags);
+}
+
+/// @brief Switch from the running task to another one, picked by Schedule
+/// 32-bit tasks just swap their stacks, going in or out of a v86 task needs
+/// a hardware task switch. The lock has to be held, the task switched to is
+/// the one that lets it go
+void Task::SwitchTo(Task::TSS &from, Task::TSS &to)
+{
+    if (&from == &to)
+        return;
+
+    FPU::SwitchOut(from);
+    if (!from.is_v86 && !to.is_v86)
+    {
+        task_cpu().hw_task->prot.esp0 = to.prot.esp0;
+        // The task may come back on another processor
+        unsigned depth = task_cpu().lock_depth;
+        Kernel_SwitchContext(&from.context, &to.context);
+        task_cpu().lock_depth = depth;
+        return;
+    }
+
+    // The state of the task that went into v86 is on the hardware TSS, so
+    // that's where leaving a v86 task goes back to. They're all pinned to
+    // the boot processor
+    auto &target = to.is_v86 ? to : *cpus[0].hw_task;
+    auto &task_entry = GDT::GetEntry(target.tss_segment);
+    if (!target.is_v86)
+        task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
+    else
+        task_entry.SetAccess(0x80 | GDT::Entry::TYPE_16TSS_AVAIL);
+    IDT::SetTaskSegment(target.tss_segment);
+    asm volatile("int $0x84\r\n"
+                 :
+                 :
+                 : "memory");
+
+    // Coming back from the hardware switch lands on the task that went into
+    // v86, not on the one the v86 task picked
+    auto flags = Task::Lock();
+    auto &cpu = task_cpu();
+    if (cpu.current != &from)
+    {
+        auto &task = *cpu.current;
+        if (&task != cpu.idle && task.is_active && task.queue == nullptr)
+            task_enqueue(task_active(cpu), task);
+        if (task_is_ready(from))
+            task_unqueue(from);
+        task_account(task, from);
+        cpu.current = &from;
+    }
+    Task::Unlock(flags);
+}
+
+Task::TSS &Task::GetCurrent()
+{
+    return *task_cpu().current;
+}
+
+/// @brief Obtain the task running on this processor, nullptr before the
+/// first one is added
+Task::TSS *Task::PeekCurrent()
+{
+    return task_cpu().current;
 }
 
 void Task::EnableSwitch()
 {
-    canSwitch = true;
+    task_cpu().can_switch = true;
 }
 
+/// @brief Keep the running task on this processor until EnableSwitch, the
+/// other processors go on scheduling
 void Task::DisableSwitch()
 {
-    canSwitch = false;
+    task_cpu().can_switch = false;
 }
 
 bool Task::CanSwitch()
 {
-    return canSwitch;
+    return task_cpu().can_switch;
 }
 
+/// @brief End the current task, never returns
 void Task::Finish()
 {
-    
+    Task::GetCurrent().is_active = false;
+    while (1)
+        Task::Switch();
+}
+
+/// @brief Block the current task for good, for drivers that stay resident
+/// and only run from their interrupt handlers
+void Task::Suspend()
+{
+    static Task::WaitQueue never;
+    while (1)
+        Task::Wait(never);
+}
+
+/* Halt until an interrupt comes whenever nothing is ready, the interrupts
+ * are only let in right before the hlt so a wake can't be missed between
+ * checking the queues and halting. The tick, only on the boot processor,
+ * stops meanwhile */
+static void task_idle()
+{
+    while (1)
+    {
+        Sync::SaveIRQ();
+        auto flags = Task::Lock();
+        auto &cpu = task_cpu();
+        bool is_idle = task_active(cpu).bitmap == 0 && task_expired(cpu).bitmap == 0
+            && task_find_steal(cpu) == nullptr;
+        Task::Unlock(flags);
+        if (is_idle)
+        {
+            bool is_boot = &cpu == &cpus[0];
+            if (is_boot)
+                ClockEvent::EnterIdle();
+            uint64_t start = Clock::Now();
+            asm volatile("\tsti\r\n"
+                         "\thlt\r\n"
+                         :
+                         :
+                         : "memory");
+            uint64_t time = Clock::Now() - start;
+            flags = Task::Lock();
+            cpu.idle_time += time;
+            Task::Unlock(flags);
+            if (is_boot)
+                ClockEvent::ExitIdle();
+        }
+        asm volatile("sti" ::: "memory");
+        Task::Switch();
+    }
+}
+
+/* The task of a processor, running its idle loop */
+static void task_set_idle(Task::TSS &task, unsigned id)
+{
+    auto flags = Task::Lock();
+    task.base_priority = task.priority = PRIORITY_IDLE;
+    if (task.queue != nullptr)
+        task_unqueue(task);
+    task.cpu = id;
+    task.is_pinned = true;
+    cpus[id].idle = &task;
+    Task::Unlock(flags);
+}
+
+/// @brief Add the task that runs when no other is ready on the boot processor
+Task::TSS &Task::AddIdle()
+{
+    auto &task = Task::Add(&task_idle, nullptr, false);
+    task.name = "idle";
+    task_set_idle(task, 0);
+    return task;
+}
+
+/// @brief Schedule tasks on a processor other than the boot one, called once
+/// it's up. The code running on it becomes its idle task, made by AddCPU
+/// @param id Number of the processor
+void Task::StartCPU(unsigned id)
+{
+    auto flags = Task::Lock();
+    auto &task = *cpus[id].idle;
+    cpus[id].current = cpus[id].hw_task = &task;
+    task.run_start = Clock::Now();
+    Task::Unlock(flags);
+    // Only for the ring transitions, see SetupTSS
+    asm volatile("\tlldt %%ax\r\n"
+                 :
+                 : "a"(task.prot.ldtr)
+                 :);
+    asm volatile("\tltr %%ax\r\n"
+                 :
+                 : "a"(task.tss_segment)
+                 :);
+    task_idle();
+    __builtin_unreachable();
+}
+
+/// @brief Obtain the nanoseconds the processors spent halted since boot
+uint64_t Task::GetIdleTime()
+{
+    auto flags = Task::Lock();
+    uint64_t time = 0;
+    for (unsigned i = 0; i < SMP::GetCount(); i++)
+        time += cpus[i].idle_time;
+    Task::Unlock(flags);
+    return time;
 }
 
+/* Where the entry point of a task returns to */
+static void task_exit()
+{
+    Task::Finish();
+}
+
+/// @brief Count the tasks, the total includes the finished tasks that
+/// haven't been freed yet
 Task::ThreadSummary Task::GetSummary()
 {
     Task::ThreadSummary ts{};
-    ts.nTotal = MAX_TASKS;
-    for (size_t i = 0; i < MAX_TASKS; i++)
-        if (tasks[i].is_active)
+    if (taskList == nullptr)
+        return ts;
+
+    ts.idleMs = Clock::ToMs(Task::GetIdleTime());
+    // Time of every processor, so it adds up with the idle time
+    ts.uptimeMs = Clock::ToMs(Clock::Now() * SMP::GetCount());
+
+    auto flags = Task::Lock();
+    auto *task = taskList;
+    do
+    {
+        ts.nTotal++;
+        if (task->is_active)
             ts.nActive++;
+        task = task->next;
+    } while (task != taskList);
+    Task::Unlock(flags);
     return ts;
 }
 
-Task::StackInfo &Task::GetStack()
+/// @brief Obtain the accounting of up to max tasks, in the order of the task
+/// list
+/// @return Number of tasks filled in
+unsigned Task::GetTasks(Task::TaskInfo *infos, unsigned max)
 {
-    for (size_t i = 0; i < MAX_TASKS; i++)
-        if (!stacks[i].is_used)
-            return stacks[i];
-    __builtin_unreachable();
+    unsigned n = 0;
+    auto flags = Task::Lock();
+    uint64_t now = Clock::Now();
+    auto *task = taskList;
+    for (unsigned id = 0; task != nullptr && n < max; id++)
+    {
+        if (task->is_active)
+        {
+            auto &info = infos[n++];
+            info.name = task->name;
+            info.id = id;
+            info.priority = task->priority;
+            info.cpu = task->cpu;
+            info.is_running = task_is_running(*task);
+            info.run_ns = task->run_time;
+            if (info.is_running)
+                info.run_ns += now - task->run_start;
+            info.life_ns = now - task->start_time;
+            info.n_voluntary = task->n_voluntary;
+            info.n_involuntary = task->n_involuntary;
+            for (unsigned i = 0; i < TASK_LATENCY_BUCKETS; i++)
+                info.latency[i] = task->latency[i];
+        }
+        task = task->next;
+        if (task == taskList)
+            break;
+    }
+    Task::Unlock(flags);
+    return n;
 }
 
 extern "C" void Kernel_Task16Trampoline();
 extern "C" void Kernel_Task32Trampoline();
+extern "C" void Kernel_TaskStart();
+
+/* Make a task and put it on the task list, without making it ready */
+static Task::TSS &task_new(void (*eip)(), void *esp, bool v86, size_t stack_size)
+{
+    // The tasks and their stacks come straight from the heap so they don't
+    // end up on the arena of the task creating them
+    auto &master = HimemAlloc::Manager::GetDefault();
+    void *mem = HimemAlloc::AlignAlloc(master, sizeof(Task::TSS), alignof(Task::TSS));
+    assert(mem != nullptr);
+    auto &task = *new (mem) Task::TSS();
+
+    if (esp == nullptr)
+    {
+        if (stack_size < MIN_STACK_SIZE)
+            stack_size = MIN_STACK_SIZE;
+        task.stack = HimemAlloc::AlignAlloc(master, stack_size, 16);
+        assert(task.stack != nullptr);
+        esp = (uint8_t *)task.stack + stack_size;
+    }
+
+    task.is_active = true;
+    task.is_v86 = v86;
+    task.arena = nullptr;
+    task.context = {};
+    task.slice = task_slice(task);
+    task.alarm.callback = task_timeout;
+    task.alarm.data = &task;
+    // v86 tasks go through the hardware TSS of the boot processor
+    task.is_pinned = v86;
+    task.cpu = v86 ? 0 : SMP::GetId();
+#ifdef HIMEM_TRACK_OWNERS
+    task.mem_allocs = task.mem_bytes = 0;
+#endif
+    task.start_time = task.run_start = Clock::Now();
+
+    auto flags = Task::Lock();
+    if (taskList == nullptr)
+        taskList = task.next = task.prev = &task;
+    else
+    {
+        task.next = taskList;
+        task.prev = taskList->prev;
+        taskList->prev->next = &task;
+        taskList->prev = &task;
+    }
+
+    // The first task of a processor is the code that is already running on
+    // it, its context gets saved on the first switch
+    auto &cpu = task_cpu();
+    if (cpu.current == nullptr)
+        cpu.current = cpu.hw_task = &task;
+    else
+    {
+        // The entry point is entered as if it was called, returning
+        // ends the task. Interrupts start disabled like on a new TSS
+        auto *sp = (uint32_t *)((uintptr_t)esp & ~(uintptr_t)15);
+        *--sp = (uintptr_t)&task_exit;
+        task.context.esp = (uintptr_t)sp;
+        task.context.eip = (uintptr_t)&Kernel_TaskStart;
+        task.context.ebx = (uintptr_t)eip;
+        task.context.eflags = 0x02;
+    }
+
+    /// @brief Setup LDT entry for this TSS
+    auto &ldt_entry = GDT::AllocateEntry();
+    ldt_entry.SetBase(&task.local_entries);
+    ldt_entry.SetLimit(sizeof(task.local_entries) - 1);
+    ldt_entry.SetAccess(0x80 | GDT::Entry::TYPE_LDT);
+    ldt_entry.access.present = 1;
+
+    auto &task_entry = GDT::AllocateEntry();
+    task_entry.SetBase(&task);
+    task_entry.SetLimit(sizeof(Task::TSS) - 1);
+    if (task.is_v86)
+        task_entry.SetAccess(0x80 | GDT::Entry::TYPE_16TSS_AVAIL);
+    else
+        task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
+    task_entry.access.present = 1;
+
+    task.tss_segment = GDT::GetEntrySegment(task_entry);
+    task.ldt_segment = GDT::GetEntrySegment(ldt_entry);
+    Task::Unlock(flags);
+
+    // Kernel code, 0x08 -- so interrupts can run
+    auto *local_entry = &task.local_entries.kern_xcode;
+    local_entry->SetBase(nullptr);
+    local_entry->SetLimit(0xFFFFFFFF);
+    local_entry->flags.size = task.is_v86 ? 0 : 1;
+    local_entry->access.present = 1;
+    local_entry->access.privilege = 0;
+    local_entry->access.always_1 = 1;
+    local_entry->access.executable = 1;
+    local_entry->access.read_write = 0;
+
+    // Kernel data, 0x10 -- so interrupts can run
+    local_entry = &task.local_entries.kern_xdata;
+    local_entry->SetBase(nullptr);
+    local_entry->SetLimit(0xFFFFFFFF);
+    local_entry->flags.size = task.is_v86 ? 0 : 1;
+    local_entry->access.present = 1;
+    local_entry->access.privilege = 0;
+    local_entry->access.always_1 = 1;
+    local_entry->access.executable = 0;
+    local_entry->access.read_write = 1;
+
+    // User entries in GDT
+    task.local_entries.user_xcode = task.local_entries.kern_xcode;
+    task.local_entries.user_xcode.access.privilege = 3;
+    task.local_entries.user_xdata = task.local_entries.kern_xdata;
+    task.local_entries.user_xdata.access.privilege = 3;
+    if (!task.is_v86)
+    {
+        task.prot.eax = 0;
+        task.prot.ebx = 0;
+        task.prot.ecx = 0;
+        task.prot.edx = 0;
+        task.prot.esi = 0;
+        task.prot.edi = 0;
+        task.prot.eip = (uintptr_t)eip;
+        task.prot.ldtr = GDT::GetEntrySegment(ldt_entry);
+        task.prot.esp = (uintptr_t)esp;
+        task.prot.ebp = task.prot.esp;
+        task.prot.esp0 = task.prot.esp;
+        task.prot.esp1 = task.prot.esp;
+        task.prot.esp2 = task.prot.esp;
+        task.prot.cs = GDT::KERNEL_XCODE | GDT::LDT_SEGMENT;
+        task.prot.ds = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.es = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.ss = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.gs = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.fs = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.ss0 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.ss1 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.ss2 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.prot.iopb = offsetof(Task::TSS, io_bitmap);
+        asm volatile("\tmov %%cr3,%%eax\r\n"
+                     "\tmov %%eax,%0\r\n"
+                     :
+                     : "m"(task.prot.cr3)
+                     :);
+        TTY::Print("task: New PROT EIP=%p,ESP=%p\n", task.prot.eip,
+                   task.prot.esp);
+        TTY::Print("ES=%p,CS=%p,DS=%p,SS=%p,GS=%p,FS=%p\n",
+                   task.prot.es, task.prot.cs, task.prot.ds,
+                   task.prot.ss, task.prot.gs, task.prot.fs);
+    }
+    else
+    {
+        task.real.ax = 0;
+        task.real.bx = 0;
+        task.real.cx = 0;
+        task.real.dx = 0;
+        task.real.si = 0;
+        task.real.di = 0;
+        task.real.ip = (uintptr_t)eip;
+        task.real.ldtr = GDT::GetEntrySegment(ldt_entry);
+        task.real.sp = (uintptr_t)esp;
+        task.real.bp = task.real.sp;
+        task.real.sp0 = task.real.sp;
+        task.real.sp1 = task.real.sp;
+        task.real.sp2 = task.real.sp;
+        task.real.cs = GDT::KERNEL_XCODE | GDT::LDT_SEGMENT;
+        task.real.ds = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.real.es = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.real.ss = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.real.ss0 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.real.ss1 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        task.real.ss2 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
+        TTY::Print("task: New REAL IP=%p,SP=%p\n", task.real.ip,
+                   task.real.sp);
+        TTY::Print("ES=%p,CS=%p,DS=%p,SS=%p\n", task.real.es,
+                   task.real.cs, task.real.ds, task.real.ss);
+    }
+
+    return task;
+}
 
 /// @brief Adds a new task
 /// @param eip EIP to set task to
-/// @param esp ESP to set stack to
+/// @param esp ESP to set stack to, nullptr to allocate a stack
 /// @param v86 Start the task in v86 mode
+/// @param stack_size Size of the allocated stack
 /// @return Task segment
-Task::TSS &Task::Add(void (*eip)(), void *esp, bool v86)
+Task::TSS &Task::Add(void (*eip)(), void *esp, bool v86, size_t stack_size)
 {
-    for (size_t i = 0; i < MAX_TASKS; i++)
+    auto &task = task_new(eip, esp, v86, stack_size);
+    // Ready once it's all set up, another processor may take it right away
+    if (&task != task_cpu().current)
     {
-        auto &task = tasks[i];
-        if (!task.is_active)
-        {
-            if (esp == nullptr)
-            {
-                auto &stack = Task::GetStack();
-                stack.is_used = true;
-                esp = &stack.stack[sizeof(stack.stack) - 1];
-            }
-
-            task.is_active = true;
-            task.is_v86 = v86;
-
-            /// @brief Setup LDT entry for this TSS
-            auto &ldt_entry = GDT::AllocateEntry();
-            ldt_entry.SetBase(&task.local_entries);
-            ldt_entry.SetLimit(sizeof(task.local_entries) - 1);
-            ldt_entry.SetAccess(0x80 | GDT::Entry::TYPE_LDT);
-            ldt_entry.access.present = 1;
-
-            auto &task_entry = GDT::AllocateEntry();
-            task_entry.SetBase(&task);
-            task_entry.SetLimit(sizeof(Task::TSS) - 1);
-            if (task.is_v86)
-                task_entry.SetAccess(0x80 | GDT::Entry::TYPE_16TSS_AVAIL);
-            else
-                task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
-            task_entry.access.present = 1;
-
-            task.tss_segment = GDT::GetEntrySegment(task_entry);
-            task.ldt_segment = GDT::GetEntrySegment(ldt_entry);
-
-            // Kernel code, 0x08 -- so interrupts can run
-            auto *local_entry = &task.local_entries.kern_xcode;
-            local_entry->SetBase(nullptr);
-            local_entry->SetLimit(0xFFFFFFFF);
-            local_entry->flags.size = task.is_v86 ? 0 : 1;
-            local_entry->access.present = 1;
-            local_entry->access.privilege = 0;
-            local_entry->access.always_1 = 1;
-            local_entry->access.executable = 1;
-            local_entry->access.read_write = 0;
-
-            // Kernel data, 0x10 -- so interrupts can run
-            local_entry = &task.local_entries.kern_xdata;
-            local_entry->SetBase(nullptr);
-            local_entry->SetLimit(0xFFFFFFFF);
-            local_entry->flags.size = task.is_v86 ? 0 : 1;
-            local_entry->access.present = 1;
-            local_entry->access.privilege = 0;
-            local_entry->access.always_1 = 1;
-            local_entry->access.executable = 0;
-            local_entry->access.read_write = 1;
-
-            // User entries in GDT
-            task.local_entries.user_xcode = task.local_entries.kern_xcode;
-            task.local_entries.user_xcode.access.privilege = 3;
-            task.local_entries.user_xdata = task.local_entries.kern_xdata;
-            task.local_entries.user_xdata.access.privilege = 3;
-            if (!task.is_v86)
-            {
-                task.prot.eax = 0;
-                task.prot.ebx = 0;
-                task.prot.ecx = 0;
-                task.prot.edx = 0;
-                task.prot.esi = 0;
-                task.prot.edi = 0;
-                task.prot.eip = (uintptr_t)eip;
-                task.prot.ldtr = GDT::GetEntrySegment(ldt_entry);
-                task.prot.esp = (uintptr_t)esp;
-                task.prot.ebp = task.prot.esp;
-                task.prot.esp0 = task.prot.esp;
-                task.prot.esp1 = task.prot.esp;
-                task.prot.esp2 = task.prot.esp;
-                task.prot.cs = GDT::KERNEL_XCODE | GDT::LDT_SEGMENT;
-                task.prot.ds = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.es = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.ss = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.gs = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.fs = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.ss0 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.ss1 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.ss2 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.prot.iopb = offsetof(Task::TSS, io_bitmap);
-                asm volatile("\tmov %%cr3,%%eax\r\n"
-                             "\tmov %%eax,%0\r\n"
-                             :
-                             : "m"(task.prot.cr3)
-                             :);
-                TTY::Print("task: New PROT EIP=%p,ESP=%p\n", task.prot.eip,
-                           task.prot.esp);
-                TTY::Print("ES=%p,CS=%p,DS=%p,SS=%p,GS=%p,FS=%p\n",
-                           task.prot.es, task.prot.cs, task.prot.ds,
-                           task.prot.ss, task.prot.gs, task.prot.fs);
-            }
-            else
-            {
-                task.real.ax = 0;
-                task.real.bx = 0;
-                task.real.cx = 0;
-                task.real.dx = 0;
-                task.real.si = 0;
-                task.real.di = 0;
-                task.real.ip = (uintptr_t)eip;
-                task.real.ldtr = GDT::GetEntrySegment(ldt_entry);
-                task.real.sp = (uintptr_t)esp;
-                task.real.bp = task.real.sp;
-                task.real.sp0 = task.real.sp;
-                task.real.sp1 = task.real.sp;
-                task.real.sp2 = task.real.sp;
-                task.real.cs = GDT::KERNEL_XCODE | GDT::LDT_SEGMENT;
-                task.real.ds = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.real.es = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.real.ss = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.real.ss0 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.real.ss1 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                task.real.ss2 = GDT::KERNEL_XDATA | GDT::LDT_SEGMENT;
-                TTY::Print("task: New REAL IP=%p,SP=%p\n", task.real.ip,
-                           task.real.sp);
-                TTY::Print("ES=%p,CS=%p,DS=%p,SS=%p\n", task.real.es,
-                           task.real.cs, task.real.ds, task.real.ss);
-            }
-            return task;
-        }
+        auto flags = Task::Lock();
+        task_ready(task);
+        Task::Unlock(flags);
     }
-    __builtin_unreachable();
+    return task;
+}
+
+/// @brief Make the idle task of a processor other than the boot one, called
+/// by the boot processor before starting it since there's no task to block
+/// on the heap until it has one. It's never ready, StartCPU runs it
+/// @param id Number of the processor
+/// @param stack Top of the stack it'll be running on
+void Task::AddCPU(unsigned id, void *stack)
+{
+    auto &task = task_new(&task_idle, stack, false, 0);
+    task.name = "idle";
+    task_set_idle(task, id);
 }
 
+/// @brief Wait for usec microseconds
 void Task::Sleep(unsigned int usec)
 {
-    while (usec--)
+    Task::SleepUntil(Clock::Now() + (uint64_t)usec * 1000);
+}
+
+/// @brief Wait until the clock reaches ns, other tasks run during the whole
+/// ticks and the rest is spun away
+void Task::SleepUntil(uint64_t ns)
+{
+    unsigned tick_ns = 1000000000 / PIT::GetRate();
+    while (1)
+    {
+        uint64_t now = Clock::Now();
+        if (now >= ns)
+            break;
+
+        // The first tick can come right away, only the ones after it are
+        // whole. Longer waits than fit a word go by parts
+        uint32_t left = (ns - now) >> 32 != 0 ? ~0u : (uint32_t)(ns - now);
+        unsigned whole = left / tick_ns;
+        if (whole < 2 || Task::PeekCurrent() == nullptr || !Task::CanSwitch())
+            break;
+        Task::WaitQueue queue;
+        Task::Wait(queue, whole - 1);
+    }
+    while (Clock::Now() < ns)
+        asm volatile("pause");
+}
+
+static inline uint32_t task_cycles()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc"
+                 : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+static Task::Context benchMain, benchPeer;
+static void task_bench_peer()
+{
+    while (1)
+        Kernel_SwitchContext(&benchPeer, &benchMain);
+}
+
+/// @brief Time both switch paths against a task that switches straight back.
+/// Only the calling processor stops switching meanwhile, the others keep
+/// running their tasks
+Task::SwitchTimes Task::MeasureSwitch(unsigned rounds)
+{
+    static uint8_t peerStack[1024] ALIGN(16);
+    static Task::TSS bounceTask ALIGN(16) = {};
+    static int bounceSegment = 0;
+
+    Task::SwitchTimes times{};
+    if (rounds == 0)
+        return times;
+
+    // The caller may have kept the scheduler out already
+    bool could_switch = Task::CanSwitch();
+    Task::DisableSwitch();
+    benchPeer = {};
+    benchPeer.esp = (uintptr_t)&peerStack[sizeof(peerStack) - 4];
+    benchPeer.eip = (uintptr_t)&task_bench_peer;
+    benchPeer.eflags = 0x02;
+    uint32_t start = task_cycles();
+    for (unsigned i = 0; i < rounds; i++)
+        Kernel_SwitchContext(&benchMain, &benchPeer);
+    times.soft = (task_cycles() - start) / rounds;
+
+    // A nested hardware switch into a task that irets right away
+    if (bounceSegment == 0)
     {
-        IO_Wait();
+        auto &task_entry = GDT::AllocateEntry();
+        task_entry.SetBase(&bounceTask);
+        task_entry.SetLimit(sizeof(Task::TSS) - 1);
+        task_entry.SetAccess(0x80 | GDT::Entry::TYPE_32TSS_AVAIL);
+        task_entry.access.present = 1;
+        bounceSegment = GDT::GetEntrySegment(task_entry);
     }
+    static uint8_t bounceStack[256] ALIGN(16);
+    bounceTask.prot.eip = (uintptr_t)&Kernel_SwitchBounce;
+    bounceTask.prot.esp = (uintptr_t)&bounceStack[sizeof(bounceStack) - 4];
+    bounceTask.prot.eflags = 0x02;
+    bounceTask.prot.cs = GDT::KERNEL_XCODE;
+    bounceTask.prot.ds = bounceTask.prot.es = bounceTask.prot.ss = GDT::KERNEL_XDATA;
+    bounceTask.prot.fs = bounceTask.prot.gs = GDT::KERNEL_XDATA;
+    bounceTask.prot.ldtr = 0;
+    bounceTask.prot.iopb = offsetof(Task::TSS, io_bitmap);
+    asm volatile("\tmov %%cr3,%%eax\r\n"
+                 "\tmov %%eax,%0\r\n"
+                 : "=m"(bounceTask.prot.cr3)
+                 :
+                 : "eax");
+    IDT::SetTaskSegment(bounceSegment);
+    start = task_cycles();
+    for (unsigned i = 0; i < rounds; i++)
+        asm volatile("int $0x84\r\n"
+                     :
+                     :
+                     : "memory");
+    times.hard = (task_cycles() - start) / rounds;
+    if (could_switch)
+        Task::EnableSwitch();
+    return times;
 }
@@ -1,24 +1,49 @@
 #ifndef TASK_HXX
 #define TASK_HXX 1
 
+#include <cstddef>
 #include <cstdint>
 #include "vendor.hxx"
 #include "gdt.hxx"
+#include "timer.hxx"
 
-#define MAX_TASKS (8)
-#define MAX_STACK_SIZE (8192)
+#define DEFAULT_STACK_SIZE (8192)
+#define MIN_STACK_SIZE (1024)
+#define NUM_PRIORITIES (32) // 0 is the highest
+#define PRIORITY_HIGH (8)
+#define PRIORITY_NORMAL (16)
+#define PRIORITY_IDLE (NUM_PRIORITIES - 1)
+#define MAX_BOOST (4) // Levels an interactive task gets raised by
+#define MIN_SLICE_TICKS (1) // Time slice of the lowest priority
+#define MAX_SLICE_TICKS (4) // Time slice of the highest priority
+#define TASK_LATENCY_BUCKETS (16) // Bucket n counts waits under 2^n us
 
 namespace IDT
 {
 void SetTaskSegment(int seg);
 }
 
+namespace HimemAlloc
+{
+struct Arena;
+}
+
 namespace Task
 {
-struct StackInfo
+struct RunQueue;
+struct WaitQueue;
+
+/// @brief State saved by the software task switch, the registers that the
+/// calling convention doesn't preserve are saved by whoever called Switch
+struct Context
 {
-    uint8_t stack[MAX_STACK_SIZE] ALIGN(4096) = {};
-    bool is_used = false;
+    uint32_t esp;
+    uint32_t eip;
+    uint32_t ebx;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t ebp;
+    uint32_t eflags;
 };
 
 // Program segment prefix for each task
@@ -147,37 +172,172 @@ struct TSS
     bool is_active = false;
     // Is this a 286 task? or a 386 one?
     bool is_v86 = false;
+    // Processor the task runs on or last ran on
+    uint8_t cpu = 0;
+    // Stays on its processor, the others don't take it
+    bool is_pinned = false;
+    // Saved by the software switch, v86 tasks use the hardware TSS instead
+    Task::Context context = {};
+    // Every task is kept on a circular list, ready or not
+    TSS *next = nullptr;
+    TSS *prev = nullptr;
+    // Stack given by Add, nullptr if the caller provided one
+    void *stack = nullptr;
+    // Priority given by SetPriority, 0 is the highest
+    uint8_t base_priority = PRIORITY_NORMAL;
+    // Priority the task runs at, higher than the base one while it holds a
+    // mutex a higher priority task waits on
+    uint8_t priority = PRIORITY_NORMAL;
+    // Levels above its priority the task runs at, one is lost per slice spent
+    uint8_t boost = 0;
+    // Ticks left of the time slice
+    uint8_t slice = 0;
+    // Level of the ready queue the task is on
+    uint8_t level = 0;
+    // Ready queue the task is on, nullptr if it isn't queued
+    Task::RunQueue *queue = nullptr;
+    TSS *run_next = nullptr;
+    TSS *run_prev = nullptr;
+    // Wait queue the task is blocked on, nullptr if it isn't blocked
+    Task::WaitQueue *wait_queue = nullptr;
+    TSS *wait_next = nullptr;
+    // Wakes the task when a timed wait runs out
+    Timer::Alarm alarm;
+    // Shown by the task list, nullptr for the ones nobody named
+    const char *name = nullptr;
+    // Accounting, in nanoseconds of the clock. A switch is voluntary when
+    // the task blocked or finished, involuntary when it was still ready
+    uint64_t start_time = 0;
+    uint64_t run_time = 0;
+    uint64_t run_start = 0;
+    uint64_t ready_since = 0; // When it was woken, 0 once it runs
+    uint32_t n_voluntary = 0;
+    uint32_t n_involuntary = 0;
+    // Time from being woken to running, log2 of the microseconds
+    uint32_t latency[TASK_LATENCY_BUCKETS] = {};
+    // FXSAVE area, allocated the first time the task uses the FPU
+    void *fpu_state = nullptr;
+    // The FPU state hasn't been saved yet, it starts from scratch
+    bool fpu_is_clean = false;
+    // Arena serving the allocations of this task, if any
+    HimemAlloc::Arena *arena = nullptr;
+#ifdef HIMEM_TRACK_OWNERS
+    // Allocations made by this task
+    size_t mem_allocs = 0;
+    size_t mem_bytes = 0;
+#endif
     uint8_t io_bitmap[256 / 8];
 } ALIGN(4);
 
+/// @brief Tasks blocked until something wakes them, in the order they came
+struct WaitQueue
+{
+    Task::TSS *head = nullptr;
+    Task::TSS *tail = nullptr;
+};
+
+void Wait(Task::WaitQueue &queue, unsigned timeout = 0);
+bool WakeOne(Task::WaitQueue &queue);
+void WakeAll(Task::WaitQueue &queue);
+uint32_t GetTicks();
+
+/// @brief Something tasks can block on until it happens, it can be set from
+/// interrupt handlers. An auto reset event wakes a single task and is reset
+/// by the task it woke, otherwise it wakes every task and stays set
+struct Event
+{
+    Event() = default;
+    explicit Event(bool _auto_reset)
+        : auto_reset{_auto_reset}
+    {
+
+    }
+    Event(Event &) = delete;
+    Event(Event &&) = delete;
+    Event &operator=(const Event &) = delete;
+
+    void Set();
+    void Reset();
+    bool Wait(unsigned timeout = 0);
+
+    bool is_set = false;
+    bool auto_reset = false;
+    Task::WaitQueue waiters;
+};
+
 Task::TSS &Schedule();
+Task::TSS &GetCurrent();
+Task::TSS *PeekCurrent();
 void EnableSwitch();
 void DisableSwitch();
 bool CanSwitch();
 void Finish();
+void Suspend();
+Task::TSS &AddIdle();
+void AddCPU(unsigned id, void *stack);
+[[noreturn]] void StartCPU(unsigned id);
+uint64_t GetIdleTime();
+void Tick();
+void SetPriority(Task::TSS &task, unsigned priority);
+void InheritPriority(Task::TSS &task, unsigned priority);
+void RestorePriority(Task::TSS &task);
+void Boost(Task::TSS &task);
+void SetInputReader(Task::TSS &task);
+void BoostInputReader();
 struct ThreadSummary
 {
     unsigned int nActive;
     unsigned int nTotal;
+    uint32_t idleMs; // Time spent halted since boot
+    uint32_t uptimeMs;
 };
 ThreadSummary GetSummary();
 
+/// @brief Accounting of a task, the running ones include their current run
+struct TaskInfo
+{
+    const char *name;
+    unsigned id; // Position on the task list
+    uint8_t priority;
+    uint8_t cpu;
+    bool is_running;
+    uint64_t run_ns;
+    uint64_t life_ns; // Time since it was added
+    uint32_t n_voluntary;
+    uint32_t n_involuntary;
+    uint32_t latency[TASK_LATENCY_BUCKETS];
+};
+unsigned GetTasks(Task::TaskInfo *infos, unsigned max);
+
+uint32_t Lock();
+void Unlock(uint32_t flags);
+void SwitchTo(Task::TSS &from, Task::TSS &to);
+
+/// @brief Give the processor to the task picked by Schedule. A task that
+/// still has time on its slice is picked again unless there's another one of
+/// the same or a higher priority ready
 static inline void Switch()
 {
     if (!Task::CanSwitch())
         return;
 
-    //asm("pushfl\r\n");
-    auto &task = Task::Schedule();
-    // Update interrupt entry accordingly
-    IDT::SetTaskSegment(task.tss_segment);
-    asm("int $0x84\r\n"
-        /*"popfl\r\n"*/);
+    auto flags = Task::Lock();
+    auto &from = Task::GetCurrent();
+    Task::SwitchTo(from, Task::Schedule());
+    Task::Unlock(flags);
 }
 
-Task::StackInfo &GetStack();
-Task::TSS &Add(void (*eip)(), void *esp, bool v86);
+/// @brief Cycles taken by a round trip (two switches) on each switch path
+struct SwitchTimes
+{
+    uint32_t soft;
+    uint32_t hard;
+};
+SwitchTimes MeasureSwitch(unsigned rounds);
+
+Task::TSS &Add(void (*eip)(), void *esp, bool v86, size_t stack_size = DEFAULT_STACK_SIZE);
 void Sleep(unsigned int usec);
+void SleepUntil(uint64_t ns);
 }
 
 #endif
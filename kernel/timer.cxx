@@ -0,0 +1,209 @@
+#include "timer.hxx"
+#include "task.hxx"
+#include "sync.hxx"
+#include "smp.hxx"
+#include "clockevent.hxx"
+
+static Timer::Slot wheel[TIMER_LEVELS][TIMER_SLOTS];
+// Alarms taken off the wheel whose callbacks are about to run
+static Timer::Slot expired;
+// Next tick the wheel has to go through
+static uint32_t wheelTicks = 0;
+static bool isRunning = false;
+
+static void timer_unlink(Timer::Alarm &alarm)
+{
+    if (alarm.prev != nullptr)
+        alarm.prev->next = alarm.next;
+    else
+        alarm.slot->head = alarm.next;
+    if (alarm.next != nullptr)
+        alarm.next->prev = alarm.prev;
+    alarm.slot = nullptr;
+    alarm.next = alarm.prev = nullptr;
+}
+
+static void timer_push(Timer::Slot &slot, Timer::Alarm &alarm)
+{
+    alarm.slot = &slot;
+    alarm.prev = nullptr;
+    alarm.next = slot.head;
+    if (slot.head != nullptr)
+        slot.head->prev = &alarm;
+    slot.head = &alarm;
+}
+
+/* Put the alarm on the lowest level that reaches its tick, the ones that are
+ * already due go on the next slot to run */
+static void timer_link(Timer::Alarm &alarm)
+{
+    uint32_t delta = alarm.expires - wheelTicks;
+    if ((int32_t)delta < 0)
+    {
+        timer_push(wheel[0][wheelTicks % TIMER_SLOTS], alarm);
+        return;
+    }
+
+    if (delta > TIMER_MAX_TICKS)
+    {
+        delta = TIMER_MAX_TICKS;
+        alarm.expires = wheelTicks + delta;
+    }
+    unsigned level = 0;
+    while (delta >> (TIMER_BITS * (level + 1)) != 0)
+        level++;
+    timer_push(wheel[level][(alarm.expires >> (TIMER_BITS * level)) % TIMER_SLOTS], alarm);
+}
+
+/* Spread the alarms of a slot over the levels below it
+ * @return Index of the slot */
+static unsigned timer_cascade(unsigned level)
+{
+    unsigned index = (wheelTicks >> (TIMER_BITS * level)) % TIMER_SLOTS;
+    auto &slot = wheel[level][index];
+    while (slot.head != nullptr)
+    {
+        auto &alarm = *slot.head;
+        timer_unlink(alarm);
+        timer_link(alarm);
+    }
+    return index;
+}
+
+/// @brief Arm the alarm to go off in some ticks, it's moved if it was armed
+/// @param ticks Ticks from now, the first one can come right away
+/// @param period Ticks between the next runs, 0 to run once
+void Timer::Arm(Timer::Alarm &alarm, unsigned ticks, unsigned period)
+{
+    Timer::ArmAt(alarm, Task::GetTicks() + ticks, period);
+}
+
+/// @brief Arm the alarm to go off at a tick, it's moved if it was armed
+/// @param period Ticks between the next runs, 0 to run once
+void Timer::ArmAt(Timer::Alarm &alarm, uint32_t tick, unsigned period)
+{
+    auto flags = Task::Lock();
+    if (alarm.slot != nullptr)
+        timer_unlink(alarm);
+    alarm.expires = tick;
+    alarm.period = period;
+    timer_link(alarm);
+    Task::Unlock(flags);
+    // Only the boot processor ticks, it may be skipping past this alarm
+    if (ClockEvent::IsIdle())
+        SMP::Kick(0);
+}
+
+/// @brief Disarm the alarm, its callback may still be running
+/// @return false if it wasn't armed
+bool Timer::Cancel(Timer::Alarm &alarm)
+{
+    auto flags = Task::Lock();
+    bool armed = alarm.slot != nullptr;
+    if (armed)
+        timer_unlink(alarm);
+    Task::Unlock(flags);
+    return armed;
+}
+
+bool Timer::IsArmed(const Timer::Alarm &alarm)
+{
+    return alarm.slot != nullptr;
+}
+
+/// @brief Obtain the ticks until the wheel has something to do, an alarm
+/// to run or a slot to cascade
+/// @param limit Most ticks to look ahead
+/// @return Ticks from now, at least 1
+unsigned Timer::NextExpiry(unsigned limit)
+{
+    auto flags = Task::Lock();
+    uint32_t now = Task::GetTicks();
+    uint32_t next = now + limit;
+    for (unsigned i = 0; i < TIMER_SLOTS; i++)
+    {
+        uint32_t tick = wheelTicks + i;
+        if ((int32_t)(tick - next) >= 0)
+            break;
+        if (wheel[0][tick % TIMER_SLOTS].head != nullptr)
+        {
+            next = tick;
+            break;
+        }
+    }
+
+    // The slots of the upper levels are cascaded on the ticks that wrap the
+    // levels below them around
+    for (unsigned level = 1; level < TIMER_LEVELS; level++)
+    {
+        unsigned shift = TIMER_BITS * level;
+        uint32_t first = (wheelTicks + (1u << shift) - 1) >> shift;
+        for (unsigned i = 0; i < TIMER_SLOTS; i++)
+        {
+            uint32_t tick = (first + i) << shift;
+            if ((int32_t)(tick - next) >= 0)
+                break;
+            if (wheel[level][(first + i) % TIMER_SLOTS].head != nullptr)
+            {
+                next = tick;
+                break;
+            }
+        }
+    }
+    Task::Unlock(flags);
+    return (int32_t)(next - now) > 0 ? next - now : 1;
+}
+
+/// @brief Run the alarms up to the current tick, bottom half of the timer
+/// interrupt. It's called with the interrupts disabled after the EOI, on the
+/// boot processor and without the lock of the scheduler. The callbacks run
+/// with the interrupts enabled, a tick that comes meanwhile leaves its alarms
+/// to the run it interrupted
+void Timer::Run()
+{
+    auto flags = Task::Lock();
+    if (isRunning)
+    {
+        Task::Unlock(flags);
+        return;
+    }
+    isRunning = true;
+
+    while ((int32_t)(Task::GetTicks() - wheelTicks) >= 0)
+    {
+        unsigned index = wheelTicks % TIMER_SLOTS;
+        for (unsigned level = 1; index == 0 && level < TIMER_LEVELS; level++)
+            index = timer_cascade(level);
+
+        // Arming an alarm from a callback may put it back on this very slot
+        auto &slot = wheel[0][wheelTicks % TIMER_SLOTS];
+        while (slot.head != nullptr)
+        {
+            auto &alarm = *slot.head;
+            timer_unlink(alarm);
+            timer_push(expired, alarm);
+        }
+        wheelTicks++;
+
+        while (expired.head != nullptr)
+        {
+            auto &alarm = *expired.head;
+            timer_unlink(alarm);
+            // Rearmed first so the callback can cancel it
+            if (alarm.period != 0)
+            {
+                alarm.expires += alarm.period;
+                timer_link(alarm);
+            }
+            auto *callback = alarm.callback;
+            auto *data = alarm.data;
+            Task::Unlock(flags);
+            asm volatile("sti" ::: "memory");
+            callback(data);
+            asm volatile("cli" ::: "memory");
+            Task::Lock();
+        }
+    }
+    isRunning = false;
+    Task::Unlock(flags);
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_HXX
+#define TIMER_HXX 1
+
+#include <cstdint>
+
+/// @brief Kernel timers
+/// Alarms are kept on a hierarchical timing wheel, each level has a slot for
+/// every tick of the one below so arming and cancelling an alarm only link
+/// or unlink it from a slot. The alarms of a level are moved down when the
+/// lower level wraps around.
+namespace Timer
+{
+#define TIMER_BITS (6)
+#define TIMER_SLOTS (1 << TIMER_BITS) // Slots of each level of the wheel
+#define TIMER_LEVELS (5)
+#define TIMER_MAX_TICKS ((1u << (TIMER_BITS * TIMER_LEVELS)) - 1) // Farthest an alarm can be armed
+
+struct Alarm;
+
+struct Slot
+{
+    Timer::Alarm *head = nullptr;
+};
+
+/// @brief Callback run some ticks from now, once or every period ticks. The
+/// callbacks run on the bottom half of the timer interrupt, with the
+/// interrupts enabled, and must not block
+struct Alarm
+{
+    Alarm() = default;
+    Alarm(void (*_callback)(void *), void *_data)
+        : callback{_callback},
+          data{_data}
+    {
+
+    }
+    Alarm(Alarm &) = delete;
+    Alarm(Alarm &&) = delete;
+    Alarm &operator=(const Alarm &) = delete;
+
+    void (*callback)(void *) = nullptr;
+    void *data = nullptr;
+    // Tick the alarm goes off at
+    uint32_t expires = 0;
+    // Ticks between the runs of a periodic alarm, 0 for a one-shot one
+    unsigned period = 0;
+    // Slot of the wheel the alarm is on, nullptr if it isn't armed
+    Timer::Slot *slot = nullptr;
+    Timer::Alarm *next = nullptr;
+    Timer::Alarm *prev = nullptr;
+};
+
+void Arm(Timer::Alarm &alarm, unsigned ticks, unsigned period = 0);
+void ArmAt(Timer::Alarm &alarm, uint32_t tick, unsigned period = 0);
+bool Cancel(Timer::Alarm &alarm);
+bool IsArmed(const Timer::Alarm &alarm);
+unsigned NextExpiry(unsigned limit);
+void Run();
+}
+
+#endif
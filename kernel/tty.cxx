@@ -6,6 +6,7 @@
 #include <cstdint>
 #include "tty.hxx"
 #include "vendor.hxx"
+#include "sync.hxx"
 
 void TTY::Terminal::Putc(char32_t ch)
 {
@@ -51,8 +52,11 @@ void TTY::Terminal::Newline()
 
 #define MAX_ATTACHED_TERMINALS 8
 static TTY::Terminal *kernelTerms[MAX_ATTACHED_TERMINALS] = {};
+// Kept while the terminals are written, interrupt handlers print too
+static Sync::Spinlock termsLock;
 void TTY::Terminal::AttachToKernel(TTY::Terminal &term)
 {
+    Sync::LockGuard<Sync::Spinlock> guard(termsLock);
     for (size_t i = 0; i < ARRAY_SIZE(kernelTerms); i++)
     {
         if (kernelTerms[i] == nullptr)
@@ -69,6 +73,7 @@ void TTY::Terminal::DetachFromKernel(TTY::Terminal &term)
     if (!term.kernelManaged)
         return;
 
+    Sync::LockGuard<Sync::Spinlock> guard(termsLock);
     for (size_t i = 0; i < ARRAY_SIZE(kernelTerms); i++)
     {
         if (kernelTerms[i] == &term)
@@ -150,6 +155,7 @@ void TTY::Vprint(const char *fmt, va_list ap)
 {
     char tmpbuf[128] = {};
     TTY::Print_1(tmpbuf, sizeof(tmpbuf), fmt, ap);
+    Sync::LockGuard<Sync::Spinlock> guard(termsLock);
     for (size_t i = 0; i < ARRAY_SIZE(kernelTerms); i++)
         if (kernelTerms[i] != nullptr)
             kernelTerms[i]->Print(tmpbuf);
@@ -1,13 +1,20 @@
 #include <utility>
 #include <algorithm>
 #include "alloc.hxx"
+#include "sync.hxx"
+#include "pool.hxx"
 #include "ui.hxx"
 
 #define MIN(x, y) ((x) > (y)) ? (y) : (x)
 #define MAX(x, y) ((x) < (y)) ? (y) : (x)
 #define CLAMP(x, min, max) MAX(MIN(x, max), min)
+#define UI_DESKTOP_GRAIN (32) // Rows of the background a job fills at least
 
 static UI::Manager ui_man(g_KFrameBuffer);
+// Held while the widget tree is walked or changed, the tasks of the programs
+// add and remove their widgets while the desktop is drawn
+static Sync::Mutex treeLock;
+#define UI_LOCK() Sync::LockGuard<Sync::Mutex> treeGuard(treeLock)
 
 UI::Manager::Manager(Framebuffer &_fb)
     : fb{_fb}
@@ -30,6 +37,7 @@ void UI::Manager::SetFramebuffer(Framebuffer &_fb)
 /// @param oy Offset y to apply to widgets
 void UI::Manager::Draw(UI::Widget &w, int ox, int oy)
 {
+    UI_LOCK();
     w.ox = w.x + ox;
     w.oy = w.y + oy;
     if (w.needs_redraw)
@@ -83,8 +91,37 @@ void UI::Manager::CheckRedraw(UI::Widget &, int, int)
 #endif
 }
 
+/// @brief Unlink the widgets allocated from an arena, before it's released
+/// Programs often return without killing their windows, their widgets are
+/// dropped without running the destructors since the arena frees them
+/// @param w Widget whose children are looked at (recursively)
+/// @param arena Arena of the program
+void UI::Manager::Detach(UI::Widget &w, const HimemAlloc::Arena &arena)
+{
+    UI_LOCK();
+    bool is_detached = false;
+    for (size_t i = 0; i < w.children.size(); )
+    {
+        auto *child = w.children[i];
+        if (!HimemAlloc::ArenaOwns(arena, child))
+        {
+            this->Detach(*child, arena);
+            i++;
+            continue;
+        }
+
+        w.children.erase(w.children.begin() + i);
+        if (this->drag_widget != nullptr && HimemAlloc::ArenaOwns(arena, this->drag_widget))
+            this->drag_widget = nullptr;
+        is_detached = true;
+    }
+    if (is_detached)
+        w.Redraw();
+}
+
 void UI::Manager::CheckUpdate(UI::Widget &w, unsigned mx, unsigned my, bool left, bool right, char32_t ch)
 {
+    UI_LOCK();
     w.inputted = false;
     if (w.OnUpdate)
         w.OnUpdate(w);
@@ -260,6 +297,7 @@ UI::Widget::Widget()
 
 UI::Widget::~Widget()
 {
+    UI_LOCK();
     if (this->parent)
     {
         auto it = std::find(std::begin(this->parent->children), std::end(this->parent->children), this);
@@ -305,6 +343,9 @@ const char *UI::Widget::GetTooltipText() const
 
 void UI::Widget::AddChildDirect(UI::Widget &w)
 {
+    /* The parent may outlive the program adding the child */
+    HimemAlloc::ArenaSuspend noArena;
+    UI_LOCK();
     this->children.push_back(&w);
     w.parent = this;
 }
@@ -353,6 +394,7 @@ void UI::Widget::DrawShadow(Color outer_color, Color inner_color, Color mid_colo
 /// @brief Force a redraw of the given widget
 void UI::Widget::Redraw()
 {
+    UI_LOCK();
     this->needs_redraw = true;
     for (const auto& child : this->children)
         child->Redraw();
@@ -360,6 +402,7 @@ void UI::Widget::Redraw()
 
 void UI::Widget::SetSkeleton(bool value)
 {
+    UI_LOCK();
     this->skeleton = value;
     for (const auto& child : this->children)
         child->SetSkeleton(value);
@@ -570,7 +613,7 @@ void UI::Window::Decorate()
     this->closeBtn->SetText("X");
     this->closeBtn->OnClick = ([](UI::Widget &w, unsigned, unsigned, bool,
                                   bool) -> void
-    { static_cast<UI::Window &>(*w.parent).isClosed = true; });
+    { static_cast<UI::Window &>(*w.parent).Close(); });
     this->AddChildDirect(this->closeBtn.value());
 
     this->minimBtn.emplace();
@@ -580,10 +623,16 @@ void UI::Window::Decorate()
     this->minimBtn->SetText("-");
     this->minimBtn->OnClick = ([](UI::Widget &w, unsigned, unsigned, bool,
                                   bool) -> void
-    { static_cast<UI::Window &>(*w.parent).isClosed = true; });
+    { static_cast<UI::Window &>(*w.parent).Close(); });
     this->AddChildDirect(this->minimBtn.value());
 }
 
+void UI::Window::Close()
+{
+    this->isClosed = true;
+    this->closeEvent.Set();
+}
+
 void UI::Window::Draw()
 {
     if (!this->skeleton)
@@ -671,39 +720,48 @@ UI::Desktop::Desktop()
     this->padding_left = 0;
 }
 
-void UI::Desktop::Draw()
+/* Fill the rows of the background in [from, to) */
+static void ui_desktop_fill(UI::Desktop &desktop, size_t from, size_t to)
 {
-    switch (background)
+    switch (desktop.background)
     {
-    case Background::SOLID:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, this->primaryColor);
+    case UI::Desktop::Background::SOLID:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, desktop.primaryColor);
         break;
-    case Background::DIAGONAL_LINES:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, Color(this->primaryColor.rgba + i + j));
+    case UI::Desktop::Background::DIAGONAL_LINES:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, Color(desktop.primaryColor.rgba + i + j));
         break;
-    case Background::MULTIPLY_GRAPH:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, Color(this->primaryColor.rgba + i * j));
+    case UI::Desktop::Background::MULTIPLY_GRAPH:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, Color(desktop.primaryColor.rgba + i * j));
         break;
-    case Background::XOR_GRAPH:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, Color(this->primaryColor.rgba + (i ^ j)));
+    case UI::Desktop::Background::XOR_GRAPH:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, Color(desktop.primaryColor.rgba + (i ^ j)));
         break;
-    case Background::AND_GRAPH:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, Color(this->primaryColor.rgba + (i & j)));
+    case UI::Desktop::Background::AND_GRAPH:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, Color(desktop.primaryColor.rgba + (i & j)));
         break;
-    case Background::OR_GRAPH:
-        for (size_t i = 0; i < this->width; i++)
-            for (size_t j = 0; j < this->height; j++)
-                g_KFrameBuffer.PlotPixel(i, j, Color(this->primaryColor.rgba + (i | j)));
+    case UI::Desktop::Background::OR_GRAPH:
+        for (size_t i = 0; i < desktop.width; i++)
+            for (size_t j = from; j < to; j++)
+                g_KFrameBuffer.PlotPixel(i, j, Color(desktop.primaryColor.rgba + (i | j)));
         break;
     }
 }
+
+/// @brief Fill the background, the rows are spread over the worker pool
+void UI::Desktop::Draw()
+{
+    Pool::ParallelFor(0, this->height, UI_DESKTOP_GRAIN, [this](size_t from, size_t to) -> void {
+        ui_desktop_fill(*this, from, to);
+    });
+}
@@ -7,6 +7,12 @@
 #include <vector>
 #include "video.hxx"
 #include "tty.hxx"
+#include "task.hxx"
+
+namespace HimemAlloc
+{
+struct Arena;
+}
 
 namespace UI
 {
@@ -33,6 +39,7 @@ public:
     void Draw(UI::Widget &w, int ox, int oy);
     void CheckRedraw(UI::Widget &w, int ox, int oy);
     void CheckUpdate(UI::Widget &w, unsigned mx, unsigned my, bool left, bool right, char32_t keypress);
+    void Detach(UI::Widget &w, const HimemAlloc::Arena &arena);
     void Update();
     void SetRoot(UI::Widget& w);
     UI::Widget* GetRoot();
@@ -156,7 +163,10 @@ struct Window : public UI::Widget
     virtual ~Window() = default;
     void Draw();
     void Decorate();
+    void Close();
     bool isClosed = false;
+    /// @brief Set once the window is closed, for the tasks waiting on it
+    Task::Event closeEvent;
     std::optional<UI::Button> closeBtn;
     std::optional<UI::Button> minimBtn;
 };
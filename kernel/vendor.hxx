@@ -75,17 +75,31 @@ namespace Task
 {
 void Sleep(unsigned int usec);
 }
+namespace Clock
+{
+uint64_t Now();
+}
 template <typename P>
 inline bool IO_TimeoutWait(int usec, P pred)
 {
-    int rem_usec = usec;
-    while (rem_usec--)
+    uint64_t until = Clock::Now() + static_cast<uint64_t>(usec) * 1000;
+    while (Clock::Now() < until)
     {
         if (pred())
             return true;
-        Task::Sleep(static_cast<unsigned int>(1));
+        asm volatile("pause");
     }
-    return false;
+    return pred();
+}
+
+/// @brief Divide 64 bits by 32, there's no libgcc to do it
+static inline uint64_t UDiv64(uint64_t n, uint32_t d)
+{
+    uint32_t hi = n >> 32, lo = n, q_hi = hi / d, q_lo, r = hi % d;
+    asm("divl %4"
+        : "=a"(q_lo), "=d"(r)
+        : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
 }
 
 constexpr static uintptr_t ComputeLinearAddr(uint32_t segment, uint32_t offset)
@@ -0,0 +1,399 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include "../kernel/alloc.hxx"
+#include "../kernel/tty.hxx"
+
+/// Replays allocation traces against HimemAlloc built for the host, so
+/// allocator changes can be measured without booting the ISO.
+///
+/// A trace has an operation per line, the objects are referred to by a
+/// number that can be reused once freed:
+///     a <id> <size>            Alloc
+///     m <id> <size> <align>    AlignAlloc
+///     r <id> <size>            Realloc
+///     f <id>                   Free
+/// Empty lines and lines starting with # are ignored.
+///
+/// Usage:
+///     allocbench <trace>...          Replay each trace and report
+///     allocbench -g <ui|launch> [n]  Write a synthetic trace to stdout
+
+// The allocator prints its errors through the TTY and the low memory one
+// wants its memory, neither is of use here
+unsigned char lowMem[0x100000];
+void TTY::Print(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    std::vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+#define BENCH_HEAP_SIZE (512 * 1024)   // Same as the static heap of the kernel
+#define BENCH_GROW_MIN (256 * 1024)    // Same as HEAP_GROW_ORDER of the kernel
+#define BENCH_RUNS 5
+
+struct Op
+{
+    char type;
+    size_t id;
+    size_t size;
+    size_t align;
+};
+
+static std::vector<Op> LoadTrace(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Can't open " + path);
+
+    std::vector<Op> ops;
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(file, line))
+    {
+        lineno++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::istringstream in(line);
+        Op op{};
+        in >> op.type >> op.id;
+        if (op.type == 'a' || op.type == 'r')
+            in >> op.size;
+        else if (op.type == 'm')
+            in >> op.size >> op.align;
+        else if (op.type != 'f')
+            in.setstate(std::ios::failbit);
+
+        if (!in)
+            throw std::runtime_error(path + ":" + std::to_string(lineno) + ": Bad operation");
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+// Memory of the heap, the static part plus what the grow handler gave
+alignas(PAGE_SIZE) static unsigned char benchHeap[BENCH_HEAP_SIZE];
+static std::map<void *, size_t> grown;
+static size_t footprint = 0, peakFootprint = 0;
+
+static void *GrowHeap(size_t& size)
+{
+    size_t grow_size = BENCH_GROW_MIN;
+    while (grow_size < size)
+        grow_size *= 2;
+
+    void *addr = std::aligned_alloc(PAGE_SIZE, grow_size);
+    if (addr == nullptr)
+        return nullptr;
+    grown[addr] = grow_size;
+    footprint += grow_size;
+    if (footprint > peakFootprint)
+        peakFootprint = footprint;
+    size = grow_size;
+    return addr;
+}
+
+static void ReleaseHeap(void *addr, size_t size)
+{
+    grown.erase(addr);
+    footprint -= size;
+    std::free(addr);
+}
+
+struct Result
+{
+    double ns_per_op = 0.;
+    size_t peak_footprint = 0;
+    size_t peak_in_use = 0;
+    unsigned fragmentation = 0; // Worst seen while replaying
+    size_t n_failed = 0;
+};
+
+/// @brief Replay a trace on a fresh manager
+/// @param sample Look at the fragmentation every this many operations, 0 to
+/// not look at all (the timed runs)
+static Result Replay(const std::vector<Op>& ops, size_t n_ids, size_t sample)
+{
+    static HimemAlloc::Manager manager;
+    HimemAlloc::InitManager(manager);
+    HimemAlloc::AddRegion(manager, benchHeap, sizeof(benchHeap));
+    manager.grow = GrowHeap;
+    manager.release = ReleaseHeap;
+    footprint = peakFootprint = sizeof(benchHeap);
+
+    Result result{};
+    std::vector<void *> ptrs(n_ids, nullptr);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        const auto& op = ops[i];
+        auto& ptr = ptrs[op.id];
+        switch (op.type)
+        {
+        case 'a':
+            ptr = HimemAlloc::Alloc(manager, op.size);
+            break;
+        case 'm':
+            ptr = HimemAlloc::AlignAlloc(manager, op.size, op.align);
+            break;
+        case 'r':
+            if (void *new_ptr = HimemAlloc::Realloc(manager, ptr, op.size); new_ptr != nullptr)
+                ptr = new_ptr;
+            break;
+        case 'f':
+            HimemAlloc::Free(manager, ptr);
+            ptr = nullptr;
+            break;
+        }
+
+        if (sample != 0 && i % sample == 0)
+        {
+            auto info = HimemAlloc::GetInfo(manager);
+            if (info.fragmentation > result.fragmentation)
+                result.fragmentation = info.fragmentation;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    auto stats = HimemAlloc::GetStats(manager);
+    result.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / ops.size();
+    result.peak_footprint = peakFootprint;
+    result.peak_in_use = stats.peak;
+    result.n_failed = stats.n_failed;
+
+    // Whatever the trace left behind and the regions kept for the low-water
+    // mark go away with the manager
+    for (auto *ptr : ptrs)
+        HimemAlloc::Free(manager, ptr);
+    for (auto& [addr, size] : grown)
+        std::free(addr);
+    grown.clear();
+    return result;
+}
+
+static void Bench(const std::string& path)
+{
+    auto ops = LoadTrace(path);
+    if (ops.empty())
+        throw std::runtime_error(path + ": Empty trace");
+
+    size_t n_ids = 0;
+    for (const auto& op : ops)
+        if (op.id >= n_ids)
+            n_ids = op.id + 1;
+
+    // Footprint and fragmentation don't depend on the timing, only the
+    // best of the timed runs is kept
+    auto result = Replay(ops, n_ids, 64);
+    result.ns_per_op = 0.;
+    for (size_t i = 0; i < BENCH_RUNS; i++)
+    {
+        auto run = Replay(ops, n_ids, 0);
+        if (result.ns_per_op == 0. || run.ns_per_op < result.ns_per_op)
+            result.ns_per_op = run.ns_per_op;
+    }
+
+    std::printf("%s: %zu ops, %.1f ns/op, peak footprint %zu KiB, peak in use %zu KiB, fragmentation %u%%, %zu failed\n",
+        path.c_str(), ops.size(), result.ns_per_op, result.peak_footprint / 1024,
+        result.peak_in_use / 1024, result.fragmentation, result.n_failed);
+}
+
+/// @brief Writes synthetic traces, the ids of freed objects are reused
+class TraceWriter
+{
+    std::vector<size_t> freeIds;
+    size_t nextId = 0;
+
+public:
+    std::mt19937 rng;
+
+    explicit TraceWriter(unsigned seed)
+        : rng{ seed }
+    {
+
+    }
+
+    size_t Range(size_t min, size_t max)
+    {
+        return std::uniform_int_distribution<size_t>(min, max)(this->rng);
+    }
+
+    size_t Alloc(size_t size, size_t align = 0)
+    {
+        size_t id = this->nextId;
+        if (!this->freeIds.empty())
+        {
+            id = this->freeIds.back();
+            this->freeIds.pop_back();
+        }
+        else
+            this->nextId++;
+
+        if (align)
+            std::printf("m %zu %zu %zu\n", id, size, align);
+        else
+            std::printf("a %zu %zu\n", id, size);
+        return id;
+    }
+
+    void Realloc(size_t id, size_t size)
+    {
+        std::printf("r %zu %zu\n", id, size);
+    }
+
+    void Free(size_t id)
+    {
+        std::printf("f %zu\n", id);
+        this->freeIds.push_back(id);
+    }
+};
+
+/// @brief Desktop use: per frame text formatting, windows with a bunch of
+/// widgets (and sometimes a backbuffer) being opened and closed
+static void GenerateUi(TraceWriter& w, size_t n_frames)
+{
+    std::printf("# UI churn, %zu frames\n", n_frames);
+    struct Window
+    {
+        std::vector<size_t> objects;
+        size_t closes_at;
+    };
+    std::vector<Window> windows;
+
+    // The desktop and the taskbar stay around
+    for (size_t i = 0; i < 24; i++)
+        w.Alloc(w.Range(96, 384));
+
+    for (size_t frame = 0; frame < n_frames; frame++)
+    {
+        // Strings formatted for the OnUpdate of the widgets
+        std::vector<size_t> temps;
+        for (size_t i = w.Range(1, 6); i > 0; i--)
+            temps.push_back(w.Alloc(w.Range(8, 300)));
+        for (auto id : temps)
+            w.Free(id);
+
+        if (windows.size() < 6 && w.Range(0, 40) == 0)
+        {
+            Window win{};
+            win.closes_at = frame + w.Range(30, 2000);
+            win.objects.push_back(w.Alloc(w.Range(256, 512)));
+            for (size_t i = w.Range(4, 40); i > 0; i--)
+            {
+                win.objects.push_back(w.Alloc(w.Range(96, 512)));
+                if (w.Range(0, 1))
+                    win.objects.push_back(w.Alloc(w.Range(8, 128)));
+            }
+            if (w.Range(0, 3) == 0)
+                win.objects.push_back(w.Alloc(w.Range(160, 320) * w.Range(120, 240) * 4, 16));
+            windows.push_back(std::move(win));
+        }
+
+        // Text of a widget changing
+        for (auto& win : windows)
+            if (w.Range(0, 20) == 0)
+                w.Realloc(win.objects[w.Range(0, win.objects.size() - 1)], w.Range(8, 512));
+
+        for (size_t i = 0; i < windows.size(); )
+        {
+            if (windows[i].closes_at > frame)
+            {
+                i++;
+                continue;
+            }
+            for (auto it = windows[i].objects.rbegin(); it != windows[i].objects.rend(); it++)
+                w.Free(*it);
+            windows.erase(windows.begin() + i);
+        }
+    }
+}
+
+/// @brief Programs being loaded and exiting: the file is read growing a
+/// buffer, its segments are copied, the arena takes chunks as the program
+/// runs and a few kernel objects outlive it
+static void GenerateLaunch(TraceWriter& w, size_t n_launches)
+{
+    std::printf("# App launches, %zu programs\n", n_launches);
+    for (size_t launch = 0; launch < n_launches; launch++)
+    {
+        std::vector<size_t> objects;
+        size_t file_size = w.Range(16, 512) * 1024;
+        size_t file = w.Alloc(4096);
+        for (size_t size = 8192; size < file_size; size *= 2)
+            w.Realloc(file, size);
+        w.Realloc(file, file_size);
+
+        for (size_t i = w.Range(1, 4); i > 0; i--)
+            objects.push_back(w.Alloc(w.Range(1, 64) * 4096, 4096));
+        w.Free(file);
+
+        for (size_t i = w.Range(1, 8); i > 0; i--)
+        {
+            objects.push_back(w.Alloc(ARENA_CHUNK_SIZE));
+            for (size_t j = w.Range(0, 20); j > 0; j--)
+            {
+                size_t id = w.Alloc(w.Range(16, 1024));
+                if (w.Range(0, 3))
+                    w.Free(id);
+            }
+        }
+
+        // Handlers, windows and such that stay after the program is gone
+        if (w.Range(0, 2) == 0)
+            w.Alloc(w.Range(32, 256));
+
+        for (auto id : objects)
+            w.Free(id);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <trace>..." << std::endl;
+        std::cerr << "       " << argv[0] << " -g <ui|launch> [count]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        if (std::strcmp(argv[1], "-g") == 0)
+        {
+            if (argc < 3)
+                throw std::runtime_error("No trace kind given");
+
+            TraceWriter w(1);
+            std::string kind = argv[2];
+            size_t count = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 0;
+            if (kind == "ui")
+                GenerateUi(w, count ? count : 20000);
+            else if (kind == "launch")
+                GenerateLaunch(w, count ? count : 500);
+            else
+                throw std::runtime_error("Unknown trace kind " + kind);
+            return EXIT_SUCCESS;
+        }
+
+        for (int i = 1; i < argc; i++)
+            Bench(argv[i]);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}